@@ -6,27 +6,98 @@
 
 #include <errno.h>
 #include <fcntl.h>
-#include <pthread.h>
 #include <string.h>
+#include <unistd.h>
 
-#include <fuse.h>
+#include <sys/param.h>
+
+#include <fuse_lowlevel.h>
 #include <sftp.h>
 #include <sftp_tree.h>
+#include <block_cache.h>
+#include <attr_cache.h>
+#include <handle_cache.h>
+#include <disk_cache.h>
+#include <inode.h>
+#include <pool.h>
 
 #include <debug.h>
 
 FILE *DEBUGFP = NULL;
-static pthread_mutex_t mutex;
 static struct sftp_node *sftp_context = NULL;
+static struct block_cache *block_cache = NULL;
+static struct disk_cache *disk_cache = NULL;
+static struct attr_cache *attr_cache = NULL;
+static struct handle_cache *handle_cache = NULL;
+static struct inode_table *inodes = NULL;
 static char *mount_point;
 
 struct options
 {
   char *config_file_path;
+  unsigned long mem_cache_size;
+  char *cache_dir;
+  unsigned long cache_size;
+  double attr_cache_ttl;
+  double negative_ttl;
+  unsigned long handle_cache_size;
+  double handle_cache_ttl;
+  unsigned long prefetch_size;
 } options;
 
+/* per open() state handed to FUSE in fi->fh. the stats file has no handle,
+ * just the text it read as when it was opened */
+struct arsenal_file
+{
+  struct sftp_tree_fd *fd;
+  struct stat st;
+  /* opened read-only, the handle can be parked on release */
+  int parkable;
+  char *stats;
+  size_t stats_len;
+  char path[];
+};
+
+/* per opendir() state handed to FUSE in fi->fh. entries come from the tree
+ * a batch at a time and FUSE asks for them a buffer at a time, `pos' is how
+ * far into the batch the listing has been handed out */
+struct arsenal_dir
+{
+  struct sftp_tree_dir *dir;
+  /* the listing of the stats directory, made up here */
+  int virtual;
+  off_t offset;
+  char *batch;
+  size_t len;
+  size_t pos;
+  char path[];
+};
+
+#define DIR_BATCH (64 * 1024)
+
 #define ARSENAL_OPT_KEY(t, p, v) { t, offsetof (struct options, p), v }
 
+#define ATTR_CACHE_BUDGET (16 * 1024 * 1024)
+
+/* how far ahead the kernel is asked to read. a single read request cannot
+ * be made larger: with the libfuse 2 API (FUSE_USE_VERSION 27) the kernel is
+ * never told it may send more than 32 pages, so reads top out at 128K
+ * whatever -o max_read says. a wider window still helps, the kernel sends it
+ * as several 128K reads at once, which FUSE_CAP_ASYNC_READ lets us serve in
+ * parallel */
+#define READAHEAD_WINDOW (1024 * 1024)
+
+/* what FUSE itself puts in a listing when it does not know the inode */
+#define UNKNOWN_INO 0xffffffff
+
+/* /.arsenal/stats, a file that reads as the counters of the whole mount in
+ * the Prometheus text format. it shadows anything of the same name on the
+ * servers. the ids are far above any the inode table hands out */
+#define STATS_DIR ".arsenal"
+#define STATS_FILE "stats"
+#define STATS_DIR_INO ((fuse_ino_t) -2)
+#define STATS_FILE_INO ((fuse_ino_t) -3)
+
 enum
 {
   KEY_VERSION,
@@ -36,6 +107,14 @@ enum
 static struct fuse_opt arsenal_opts[] =
 {
   ARSENAL_OPT_KEY ("cfg=%s", config_file_path, 0),
+  ARSENAL_OPT_KEY ("mem_cache_size=%lu", mem_cache_size, 0),
+  ARSENAL_OPT_KEY ("cache_dir=%s", cache_dir, 0),
+  ARSENAL_OPT_KEY ("cache_size=%lu", cache_size, 0),
+  ARSENAL_OPT_KEY ("attr_cache_ttl=%lf", attr_cache_ttl, 0),
+  ARSENAL_OPT_KEY ("negative_ttl=%lf", negative_ttl, 0),
+  ARSENAL_OPT_KEY ("handle_cache_size=%lu", handle_cache_size, 0),
+  ARSENAL_OPT_KEY ("handle_cache_ttl=%lf", handle_cache_ttl, 0),
+  ARSENAL_OPT_KEY ("prefetch_size=%lu", prefetch_size, 0),
   FUSE_OPT_KEY ("-V", KEY_VERSION),
   FUSE_OPT_KEY ("--version", KEY_VERSION),
   FUSE_OPT_KEY ("-h", KEY_HELP),
@@ -43,242 +122,973 @@ static struct fuse_opt arsenal_opts[] =
   FUSE_OPT_END
 };
 
+/* the attributes of the stats directory and file. returns -1 for any other
+ * id */
 static int
-arsenal_getattr (const char *path, struct stat *buf)
+stats_attr (fuse_ino_t ino, struct stat *st)
+{
+  if (STATS_DIR_INO != ino && STATS_FILE_INO != ino)
+    return -1;
+
+  memset (st, 0, sizeof *st);
+  st->st_ino = ino;
+  st->st_uid = getuid ();
+  st->st_gid = getgid ();
+  if (STATS_DIR_INO == ino)
+    {
+      st->st_mode = S_IFDIR | 0555;
+      st->st_nlink = 2;
+    }
+  else
+    {
+      /* the size is unknown until it is read, reads ignore it */
+      st->st_mode = S_IFREG | 0444;
+      st->st_nlink = 1;
+    }
+  return 0;
+}
+
+struct pool_metric
+{
+  FILE *fp;
+  const char *metric;
+  int reuses;
+};
+
+static void
+pool_metric (void *ctx, const char *name, uint64_t allocs, uint64_t reuses)
+{
+  struct pool_metric *m = ctx;
+
+  fprintf (m->fp, "%s{pool=\"%s\"} %lu\n", m->metric, name,
+           m->reuses ? reuses : allocs);
+}
+
+/* the text of the stats file: the caches and pools kept here, then
+ * everything the tree counts */
+static char *
+stats_render (size_t *len)
+{
+  static const struct
+  {
+    const char *metric;
+    const char *type;
+    const char *help;
+  } cache_metrics[] =
+  {
+    {"arsenal_cache_hits_total", "counter", "Lookups the cache answered."},
+    {"arsenal_cache_misses_total", "counter", "Lookups the cache missed."},
+    {"arsenal_cache_evictions_total", "counter",
+     "Entries dropped to make room."},
+    {"arsenal_cache_entries", "gauge", "Entries held."},
+    {"arsenal_cache_bytes", "gauge", "Bytes held."},
+    {"arsenal_cache_hit_ratio", "gauge", "Hits over lookups so far."}
+  };
+  struct
+  {
+    const char *name;
+    int present;
+    struct lru_stats st;
+  } caches[5];
+  const char *pool_metrics[][2] =
+  {
+    {"arsenal_pool_allocs_total", "Objects that had to be allocated."},
+    {"arsenal_pool_reuses_total", "Objects recycled instead."}
+  };
+  struct lru_stats negative;
+  FILE *fp;
+  char *buf = NULL;
+  size_t size = 0;
+  size_t i, j;
+
+  if (NULL == (fp = open_memstream (&buf, &size)))
+    {
+      print_error ("open_memstream: %s", strerror (errno));
+      return NULL;
+    }
+
+  caches[0].name = "block";
+  caches[0].present = NULL != block_cache;
+  block_cache_stats (block_cache, &caches[0].st);
+  caches[1].name = "disk";
+  caches[1].present = NULL != disk_cache;
+  disk_cache_stats (disk_cache, &caches[1].st);
+  caches[2].name = "attr";
+  caches[2].present = NULL != attr_cache;
+  attr_cache_stats (attr_cache, &caches[2].st, &negative);
+  caches[3].name = "negative";
+  caches[3].present = NULL != attr_cache;
+  caches[3].st = negative;
+  caches[4].name = "handle";
+  caches[4].present = NULL != handle_cache;
+  handle_cache_stats (handle_cache, &caches[4].st);
+
+  for (i = 0; i < sizeof cache_metrics / sizeof *cache_metrics; i++)
+    {
+      fprintf (fp, "# HELP %s %s\n# TYPE %s %s\n", cache_metrics[i].metric,
+               cache_metrics[i].help, cache_metrics[i].metric,
+               cache_metrics[i].type);
+      for (j = 0; j < sizeof caches / sizeof *caches; j++)
+        {
+          struct lru_stats *st = &caches[j].st;
+          uint64_t v[] = {st->hits, st->misses, st->evictions, st->entries,
+                          st->bytes};
+
+          if (!caches[j].present)
+            continue;
+          fprintf (fp, "%s{cache=\"%s\"} ", cache_metrics[i].metric,
+                   caches[j].name);
+          if (i < sizeof v / sizeof *v)
+            fprintf (fp, "%lu\n", v[i]);
+          else
+            fprintf (fp, "%g\n", st->hits + st->misses
+                                 ? (double) st->hits / (st->hits + st->misses)
+                                 : 0);
+        }
+    }
+
+  for (i = 0; i < 2; i++)
+    {
+      struct pool_metric m = {fp, pool_metrics[i][0], 1 == i};
+      fprintf (fp, "# HELP %s %s\n# TYPE %s counter\n", pool_metrics[i][0],
+               pool_metrics[i][1], pool_metrics[i][0]);
+      pool_walk (pool_metric, &m);
+    }
+
+  fprintf (fp, "# HELP arsenal_inodes Inodes the kernel holds.\n"
+           "# TYPE arsenal_inodes gauge\narsenal_inodes %lu\n",
+           inode_count (inodes));
+
+  sftp_tree_metrics (sftp_context, fp);
+
+  if (0 != fclose (fp))
+    {
+      print_error ("fclose: %s", strerror (errno));
+      free (buf);
+      return NULL;
+    }
+  *len = size;
+  return buf;
+}
+
+/* lstat `path' through the attribute cache. returns 0 or an errno */
+static int
+lstat_path (const char *path, struct stat *buf)
 {
   memset (buf, 0, sizeof *buf);
 
+  if (0 == attr_cache_get (attr_cache, path, buf))
+    return 0;
+
+  if (attr_cache_missing (attr_cache, path))
+    return ENOENT;
+
   if (sftp_tree_lstat (sftp_context, path, buf) < 0)
     {
-      print_error ("sftp_lstat");
-      errno = ENOENT;
-      return -1;
+      /* only a definite answer is worth remembering, not a server that
+       * could not be reached */
+      if (ENOENT != errno)
+        {
+          print_error ("sftp_lstat");
+          return EIO;
+        }
+      attr_cache_put_missing (attr_cache, path);
+      return ENOENT;
     }
+
+  attr_cache_put (attr_cache, path, buf);
   return 0;
 }
 
-static int
-arsenal_readlink (const char *path, char *buf, size_t bufsize)
+static void
+arsenal_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  struct fuse_entry_param e;
+  char path[PATH_MAX];
+  int err;
+
+  memset (&e, 0, sizeof e);
+  if (STATS_DIR_INO == parent
+      || (INODE_ROOT == parent && 0 == strcmp (name, STATS_DIR)))
+    {
+      if (INODE_ROOT == parent)
+        e.ino = STATS_DIR_INO;
+      else if (0 == strcmp (name, STATS_FILE))
+        e.ino = STATS_FILE_INO;
+      else
+        {
+          fuse_reply_err (req, ENOENT);
+          return;
+        }
+      stats_attr (e.ino, &e.attr);
+      e.entry_timeout = options.attr_cache_ttl;
+      fuse_reply_entry (req, &e);
+      return;
+    }
+
+  if (inode_child_path (inodes, parent, name, path, sizeof path) < 0)
+    {
+      fuse_reply_err (req, ENAMETOOLONG);
+      return;
+    }
+
+  if (0 != (err = lstat_path (path, &e.attr)))
+    {
+      /* an entry with no inode is how the kernel is told to remember that
+       * the name does not exist */
+      if (ENOENT == err && 0 < options.negative_ttl)
+        {
+          e.entry_timeout = options.negative_ttl;
+          fuse_reply_entry (req, &e);
+        }
+      else
+        fuse_reply_err (req, err);
+      return;
+    }
+
+  if (0 == (e.ino = inode_lookup (inodes, path, &e.attr)))
+    {
+      fuse_reply_err (req, ENOMEM);
+      return;
+    }
+  e.attr.st_ino = e.ino;
+  e.attr_timeout = options.attr_cache_ttl;
+  e.entry_timeout = options.attr_cache_ttl;
+
+  /* the lookup is not counted by the kernel if the reply does not reach
+   * it, so it must not be counted here either */
+  if (0 != fuse_reply_entry (req, &e))
+    inode_forget (inodes, e.ino, 1);
+}
+
+static void
+arsenal_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  inode_forget (inodes, ino, nlookup);
+  fuse_reply_none (req);
+}
+
+static void
+arsenal_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+  struct stat st;
+  char path[PATH_MAX];
   int err;
+  (void) fi;
+
+  if (0 == stats_attr (ino, &st))
+    {
+      fuse_reply_attr (req, &st, 0);
+      return;
+    }
+
+  if (0 == inode_getattr (inodes, ino, options.attr_cache_ttl, &st))
+    {
+      fuse_reply_attr (req, &st, options.attr_cache_ttl);
+      return;
+    }
+
+  if (inode_path (inodes, ino, path, sizeof path) < 0)
+    {
+      fuse_reply_err (req, ENOENT);
+      return;
+    }
 
-  if ((err = sftp_tree_realpath (sftp_context, path, buf, bufsize)) < 0)
+  if (0 != (err = lstat_path (path, &st)))
+    {
+      fuse_reply_err (req, err);
+      return;
+    }
+
+  inode_setattr (inodes, ino, &st);
+  st.st_ino = ino;
+  fuse_reply_attr (req, &st, options.attr_cache_ttl);
+}
+
+static void
+arsenal_readlink (fuse_req_t req, fuse_ino_t ino)
+{
+  char path[PATH_MAX];
+  char buf[PATH_MAX];
+
+  if (inode_path (inodes, ino, path, sizeof path) < 0)
+    {
+      fuse_reply_err (req, ENOENT);
+      return;
+    }
+
+  memset (buf, 0, sizeof buf);
+  if (sftp_tree_realpath (sftp_context, path, buf, sizeof buf - 1) < 0)
     {
       print_error ("sftp_realpath");
-      return -1;
+      fuse_reply_err (req, EIO);
+      return;
     }
 
-  return 0;
+  fuse_reply_readlink (req, buf);
 }
 
 static int
-arsenal_open (const char *path, struct fuse_file_info *fi)
+file_close (struct arsenal_file *file)
 {
-  if (0 == (fi->fh = (uint64_t) sftp_tree_open (sftp_context, path, fi->flags,
-                                           O_RDONLY)))
+  int err = 0;
+
+  if (NULL != file->fd)
+    err = sftp_tree_close (file->fd);
+  free (file->stats);
+  free (file);
+  return err;
+}
+
+static void
+handle_close (void *handle)
+{
+  if (sftp_tree_close ((struct sftp_tree_fd *) handle) < 0)
+    print_error ("sftp_close");
+}
+
+/* a handle parked on `path' by an earlier release, if the file has not
+ * changed since. the attributes to check against are usually still fresh
+ * from the lookup that came before the open, so this rarely costs a trip to
+ * the server, and never when nothing is parked */
+static struct sftp_tree_fd *
+file_unpark (fuse_ino_t ino, const char *path)
+{
+  struct stat st;
+
+  if (!handle_cache_parked (handle_cache, path))
+    return NULL;
+
+  if (0 != inode_getattr (inodes, ino, options.attr_cache_ttl, &st)
+      && 0 != lstat_path (path, &st))
+    return NULL;
+
+  if (!S_ISREG (st.st_mode))
+    return NULL;
+  return handle_cache_get (handle_cache, path, &st);
+}
+
+/* the stats file is rendered once per open, so that its reads see one
+ * snapshot. its size is not known up front, direct_io has the kernel pass
+ * on every read instead of stopping at st_size */
+static void
+stats_open (fuse_req_t req, struct fuse_file_info *fi)
+{
+  struct arsenal_file *file;
+
+  if (NULL == (file = calloc (1, sizeof *file + 1)))
+    {
+      print_error ("Out of memory");
+      fuse_reply_err (req, ENOMEM);
+      return;
+    }
+
+  if (NULL == (file->stats = stats_render (&file->stats_len)))
+    {
+      free (file);
+      fuse_reply_err (req, EIO);
+      return;
+    }
+
+  fi->direct_io = 1;
+  fi->fh = (uint64_t) file;
+  if (0 != fuse_reply_open (req, fi))
+    file_close (file);
+}
+
+static ssize_t
+fill_from_fd (void *ctx, char *buf, size_t size, off_t offset)
+{
+  return sftp_tree_read ((struct sftp_tree_fd *) ctx, buf, size, offset);
+}
+
+/* read a small file whole right away, in one request, rather than in a
+ * string of reads each waiting on the last. with a block cache the file goes
+ * there: blocks it already holds are not fetched again and the data is not
+ * kept twice. without one the handle keeps it, and a handle reused from the
+ * handle cache has its contents already */
+static void
+file_prefetch (struct arsenal_file *file)
+{
+  struct block_read *r;
+
+  if (0 == options.prefetch_size)
+    return;
+
+  if (NULL == block_cache)
+    {
+      if (sftp_tree_prefetch (file->fd, options.prefetch_size * 1024) < 0)
+        print_error ("sftp_tree_prefetch: reading on demand");
+      return;
+    }
+
+  if (!S_ISREG (file->st.st_mode) || file->st.st_size <= 0
+      || options.prefetch_size * 1024 < (unsigned long) file->st.st_size)
+    return;
+
+  if (NULL == (r = block_cache_read (block_cache, file->path, &file->st,
+                                     file->st.st_size, 0, fill_from_fd,
+                                     file->fd)))
+    print_error ("block_cache_read: reading on demand");
+  block_read_free (r);
+}
+
+static void
+arsenal_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct arsenal_file *file;
+  char path[PATH_MAX];
+
+  if (STATS_FILE_INO == ino)
+    {
+      stats_open (req, fi);
+      return;
+    }
+  if (STATS_DIR_INO == ino)
+    {
+      fuse_reply_err (req, EISDIR);
+      return;
+    }
+
+  if (inode_path (inodes, ino, path, sizeof path) < 0)
+    {
+      fuse_reply_err (req, ENOENT);
+      return;
+    }
+
+  if (NULL == (file = malloc (sizeof *file + strlen (path) + 1)))
+    {
+      print_error ("Out of memory");
+      fuse_reply_err (req, ENOMEM);
+      return;
+    }
+  file->stats = NULL;
+  file->stats_len = 0;
+
+  file->parkable = NULL != handle_cache
+                   && O_RDONLY == (fi->flags & O_ACCMODE);
+  file->fd = file->parkable ? file_unpark (ino, path) : NULL;
+
+  if (NULL == file->fd
+      && NULL == (file->fd = sftp_tree_open (sftp_context, path, fi->flags,
+                                             O_RDONLY)))
     {
       print_error ("sftp_open");
-      return -EACCES;
+      free (file);
+      fuse_reply_err (req, EACCES);
+      return;
     }
-  return 0;
+
+  /* size and mtime at open time validate the cached blocks of this file.
+   * picking the node that holds the file already required an fstat, so this
+   * does not go back to the server */
+  if (sftp_tree_fstat (file->fd, &file->st) < 0)
+    {
+      print_error ("sftp_fstat");
+      file_close (file);
+      fuse_reply_err (req, EACCES);
+      return;
+    }
+
+  /* fstat follows symlinks, so it may only refresh entries for plain paths */
+  {
+    struct stat old;
+    if (0 == attr_cache_get (attr_cache, path, &old) && !S_ISLNK (old.st_mode))
+      {
+        attr_cache_put (attr_cache, path, &file->st);
+        inode_setattr (inodes, ino, &file->st);
+      }
+  }
+
+  strcpy (file->path, path);
+  file_prefetch (file);
+  fi->fh = (uint64_t) file;
+
+  /* the open was interrupted, nobody is going to release it */
+  if (0 != fuse_reply_open (req, fi))
+    file_close (file);
 }
 
-static int
-arsenal_read (const char *path, char *buf, size_t size, off_t offset,
-            struct fuse_file_info *fi)
+static void
+arsenal_read (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+              struct fuse_file_info *fi)
 {
-  int amount_read;
-  (void) path;
-  (void) offset;
+  struct arsenal_file *file = (struct arsenal_file *) fi->fh;
+  const struct block_piece *pieces;
+  struct fuse_bufvec *bufv;
+  struct block_read *r;
+  size_t count;
+  size_t i;
+  (void) ino;
 
-  pthread_mutex_lock (&mutex);
-  amount_read = sftp_read ((struct sftp_fd *) fi->fh, buf, size, offset);
-  if (amount_read <= 0)
+  if (NULL == file->fd)
+    {
+      if ((off_t) file->stats_len <= offset)
+        fuse_reply_buf (req, NULL, 0);
+      else
+        fuse_reply_buf (req, file->stats + offset,
+                        MIN (size, file->stats_len - offset));
+      return;
+    }
+
+  /* no global lock here: the handle is bound to one of its volume's sftp
+   * channels and its requests queue up on that channel alone, next to those
+   * of other handles on the same session. files below a mirror
+   * may be read from several replicas at once. blocks missing from the cache
+   * are fetched together, in one pipelined read */
+  if (NULL == (r = block_cache_read (block_cache, file->path, &file->st, size,
+                                     offset, fill_from_fd, file->fd)))
     {
       print_error ("sftp_read");
-      if (errno == EOF)
-        {
-          print_error ("sftp_read: EOF");
-          pthread_mutex_unlock (&mutex);
-          return -EOF;
-        }
-      pthread_mutex_unlock (&mutex);
-      return -ENOENT;
+      fuse_reply_err (req, ENOENT);
+      return;
     }
-  pthread_mutex_unlock (&mutex);
-  return amount_read;
+
+  pieces = block_read_pieces (r, &count);
+  if (NULL == (bufv = malloc (sizeof *bufv + count * sizeof *bufv->buf)))
+    {
+      print_error ("Out of memory");
+      fuse_reply_err (req, ENOMEM);
+      block_read_free (r);
+      return;
+    }
+
+  /* the reply points at the cached blocks themselves. pieces in the disk
+   * cache are spliced from its data file when the kernel allows it, and
+   * never pass through this process. they are spliced by reference, not
+   * moved: a move may take the pages out of the data file's page cache, and
+   * the next hit on a hot block would go back to the disk */
+  bufv->count = count;
+  bufv->idx = 0;
+  bufv->off = 0;
+  for (i = 0; i < count; i++)
+    {
+      bufv->buf[i].size = pieces[i].len;
+      bufv->buf[i].mem = (void *) pieces[i].mem;
+      bufv->buf[i].fd = pieces[i].fd;
+      bufv->buf[i].pos = pieces[i].pos;
+      bufv->buf[i].flags = 0 > pieces[i].fd ? 0
+                           : FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    }
+
+  if (0 == count)
+    fuse_reply_buf (req, NULL, 0);
+  else
+    fuse_reply_data (req, bufv, 0);
+  free (bufv);
+  block_read_free (r);
 }
 
-static int
-arsenal_statfs (const char *path, struct statvfs *buf)
+static void
+arsenal_statfs (fuse_req_t req, fuse_ino_t ino)
 {
-  if (sftp_tree_statvfs (sftp_context, path, buf) < 0)
+  struct statvfs buf;
+  char path[PATH_MAX];
+
+  if (inode_path (inodes, ino, path, sizeof path) < 0)
+    strcpy (path, "/");
+
+  if (sftp_tree_statvfs (sftp_context, path, &buf) < 0)
     {
       print_error ("sftp_statvfs");
-      return -1;
+      fuse_reply_err (req, EIO);
+      return;
     }
-  return 0;
+  fuse_reply_statfs (req, &buf);
 }
 
-static int
-arsenal_release (const char *path, struct fuse_file_info *fi)
+static void
+arsenal_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  (void) path;
-  return sftp_close ((struct sftp_fd *) fi->fh);
+  struct arsenal_file *file = (struct arsenal_file *) fi->fh;
+  (void) ino;
+
+  /* the next open of the same file picks the handle up where it is */
+  if (file->parkable)
+    {
+      handle_cache_put (handle_cache, file->path, file->fd, &file->st);
+      free (file);
+      fuse_reply_err (req, 0);
+      return;
+    }
+
+  if (file_close (file) < 0)
+    fuse_reply_err (req, EIO);
+  else
+    fuse_reply_err (req, 0);
 }
 
-static int
-arsenal_opendir (const char *path, struct fuse_file_info *fi)
+/* the stats directory, listed from a batch put together here */
+static void
+stats_opendir (fuse_req_t req, struct fuse_file_info *fi)
+{
+  static const char *names[] = {".", "..", STATS_FILE};
+  struct arsenal_dir *dir;
+  struct sftp_dirent *e;
+  size_t i;
+
+  if (NULL == (dir = calloc (1, sizeof *dir + 1))
+      || NULL == (dir->batch = malloc (DIR_BATCH)))
+    {
+      print_error ("Out of memory");
+      free (dir);
+      fuse_reply_err (req, ENOMEM);
+      return;
+    }
+
+  dir->virtual = 1;
+  for (i = 0; i < sizeof names / sizeof *names; i++)
+    {
+      e = (struct sftp_dirent *) (dir->batch + dir->len);
+      e->reclen = SFTP_DIRENT_SIZE (strlen (names[i]));
+      stats_attr (2 == i ? STATS_FILE_INO : STATS_DIR_INO, &e->st);
+      strcpy (e->name, names[i]);
+      dir->len += e->reclen;
+    }
+
+  fi->fh = (uint64_t) dir;
+  if (0 != fuse_reply_open (req, fi))
+    {
+      free (dir->batch);
+      free (dir);
+    }
+}
+
+static void
+arsenal_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  if (0 == (fi->fh = (uint64_t) sftp_tree_opendir (sftp_context, path)))
+  struct arsenal_dir *dir;
+  char path[PATH_MAX];
+
+  if (STATS_DIR_INO == ino)
+    {
+      stats_opendir (req, fi);
+      return;
+    }
+
+  if (inode_path (inodes, ino, path, sizeof path) < 0)
+    {
+      fuse_reply_err (req, ENOENT);
+      return;
+    }
+
+  if (NULL == (dir = calloc (1, sizeof *dir + strlen (path) + 1)))
+    {
+      print_error ("Out of memory");
+      fuse_reply_err (req, ENOMEM);
+      return;
+    }
+
+  if (NULL == (dir->dir = sftp_tree_opendir (sftp_context, path)))
     {
       print_error ("sftp_opendir");
-      return -ENOENT;
+      free (dir);
+      fuse_reply_err (req, ENOENT);
+      return;
     }
-  return 0;
+
+  strcpy (dir->path, path);
+  fi->fh = (uint64_t) dir;
+  if (0 != fuse_reply_open (req, fi))
+    {
+      sftp_tree_closedir (dir->dir);
+      free (dir);
+    }
+}
+
+/* the next entry of the listing, left in place until the caller moves
+ * `pos' past it */
+static struct sftp_dirent *
+dir_next (struct arsenal_dir *dir)
+{
+  ssize_t len;
+
+  if (dir->pos == dir->len)
+    {
+      if (NULL == dir->dir)
+        return NULL;
+      if (NULL == dir->batch && NULL == (dir->batch = malloc (DIR_BATCH)))
+        {
+          print_error ("Out of memory");
+          return NULL;
+        }
+      dir->pos = dir->len = 0;
+      if ((len = sftp_tree_readdir (dir->dir, dir->batch, DIR_BATCH)) <= 0)
+        return NULL;
+      dir->len = len;
+    }
+
+  return (struct sftp_dirent *) (dir->batch + dir->pos);
 }
 
+/* seeking means listing again from the start up to `offset' */
 static int
-arsenal_readdir (const char *path, void *buf, fuse_fill_dir_t filler,
-               off_t offset, struct fuse_file_info *fi)
+dir_seek (struct arsenal_dir *dir, off_t offset)
 {
-  struct dirent *entry;
-  int err = -1;
+  struct sftp_dirent *entry;
 
-  (void) path;
-  (void) offset;
-  (void) fi;
+  if (offset < dir->offset && dir->virtual)
+    {
+      dir->pos = 0;
+      dir->offset = 0;
+    }
+  else if (offset < dir->offset)
+    {
+      dir->pos = dir->len = 0;
+      if (NULL != dir->dir)
+        sftp_tree_closedir (dir->dir);
+      dir->offset = 0;
+      if (NULL == (dir->dir = sftp_tree_opendir (sftp_context, dir->path)))
+        {
+          print_error ("sftp_opendir");
+          return -1;
+        }
+    }
 
-  pthread_mutex_lock (&mutex);
-  while (NULL != (entry = sftp_readdir ((struct sftp_dir *) fi->fh)))
+  while (dir->offset < offset && NULL != (entry = dir_next (dir)))
     {
-      filler (buf, entry->d_name, NULL, 0);
-      free (entry);
-      err = 0;
+      dir->pos += entry->reclen;
+      dir->offset++;
     }
-  pthread_mutex_unlock (&mutex);
-  return err;
+  return 0;
 }
 
-static int
-arsenal_releasedir (const char *path, struct fuse_file_info *fi)
+static void
+arsenal_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                 struct fuse_file_info *fi)
 {
-  (void) path;
+  struct arsenal_dir *dir = (struct arsenal_dir *) fi->fh;
+  struct sftp_dirent *entry;
+  struct stat st;
+  char child[PATH_MAX];
+  char *buf;
+  size_t used = 0;
+  size_t len;
+  (void) ino;
 
-  if (sftp_closedir ((struct sftp_dir *) fi->fh) < 0)
+  if (offset != dir->offset && dir_seek (dir, offset) < 0)
+    {
+      fuse_reply_err (req, EIO);
+      return;
+    }
+
+  if (NULL == (buf = malloc (size)))
+    {
+      print_error ("Out of memory");
+      fuse_reply_err (req, ENOMEM);
+      return;
+    }
+
+  /* the server sends attributes along with every name, keep them for the
+   * lookups that usually follow a listing */
+  while (NULL != (entry = dir_next (dir)))
+    {
+      st = entry->st;
+      if (0 == st.st_mode)
+        memset (&st, 0, sizeof st);
+      st.st_ino = UNKNOWN_INO;
+      len = fuse_add_direntry (req, buf + used, size - used, entry->name,
+                               &st, dir->offset + 1);
+      if (size - used < len)
+        break;
+      used += len;
+      dir->pos += entry->reclen;
+      dir->offset++;
+
+      if (!dir->virtual && 0 != st.st_mode && strcmp (entry->name, ".")
+          && strcmp (entry->name, "..")
+          && snprintf (child, sizeof child, "%s/%s",
+                       strcmp (dir->path, "/") ? dir->path : "",
+                       entry->name) < (int) sizeof child)
+        attr_cache_put (attr_cache, child, &st);
+    }
+
+  fuse_reply_buf (req, buf, used);
+  free (buf);
+}
+
+static void
+arsenal_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct arsenal_dir *dir = (struct arsenal_dir *) fi->fh;
+  int err = 0;
+  (void) ino;
+
+  if (NULL != dir->dir && sftp_tree_closedir (dir->dir) < 0)
     {
       print_error ("sftp_closedir");
-      return -1;
+      err = EIO;
     }
-  return 0;
+  free (dir->batch);
+  free (dir);
+  fuse_reply_err (req, err);
 }
 
-static void *
-arsenal_init (struct fuse_conn_info *conn)
+static void
+arsenal_init (void *userdata, struct fuse_conn_info *conn)
 {
-  (void) conn;
+  (void) userdata;
 
-  if (NULL == (DEBUGFP = fopen (DEBUGLOG, "a+")))
-    return NULL;
+  /* FUSE settles on the smaller of this and what the kernel offers */
+  conn->max_readahead = READAHEAD_WINDOW;
+  conn->want |= FUSE_CAP_ASYNC_READ;
 
-  pthread_mutex_init (&mutex, NULL);
+  /* reads are answered with pieces of the disk cache's data file where
+   * possible, let the kernel splice those. no FUSE_CAP_SPLICE_MOVE, see
+   * arsenal_read */
+  conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+
+  if (NULL == (DEBUGFP = fopen (DEBUGLOG, "a+")))
+    return;
 
   if (NULL == options.config_file_path)
     {
       print_error ("Must specify configuration file");
-      return NULL;
+      return;
     }
 
   sftp_context = sftp_tree_init (options.config_file_path, mount_point);
   if (NULL == sftp_context)
     {
       print_error ("sftp_tree_init");
-      return NULL;
+      return;
     }
-  return NULL;
-}
 
-static void
-arsenal_destroy (void *vptr)
-{
-  (void) vptr;
-  sftp_tree_destroy (sftp_context);
-  fclose (DEBUGFP);
-  pthread_mutex_destroy (&mutex);
+  if ((0 < options.attr_cache_ttl || 0 < options.negative_ttl)
+      && NULL == (attr_cache = attr_cache_new (options.attr_cache_ttl,
+                                               options.negative_ttl,
+                                               ATTR_CACHE_BUDGET)))
+    print_error ("attr_cache_new: continuing without an attribute cache");
+
+  if (0 < options.handle_cache_size && 0 < options.handle_cache_ttl
+      && NULL == (handle_cache = handle_cache_new (options.handle_cache_size,
+                                                   options.handle_cache_ttl,
+                                                   handle_close)))
+    print_error ("handle_cache_new: continuing without a handle cache");
+
+  if (NULL != options.cache_dir
+      && NULL == (disk_cache = disk_cache_open (options.cache_dir,
+                                                options.cache_size
+                                                * 1024 * 1024, BLOCK_SIZE)))
+    print_error ("disk_cache_open: continuing without a disk cache");
+
+  if ((0 < options.mem_cache_size || NULL != disk_cache)
+      && NULL == (block_cache = block_cache_new (options.mem_cache_size
+                                                 * 1024 * 1024, disk_cache)))
+    print_error ("block_cache_new: continuing without a block cache");
 }
 
-static int
-arsenal_fgetattr (const char *path, struct stat *buf, struct fuse_file_info *fi)
+static void
+arsenal_destroy (void *userdata)
 {
-  (void) path;
+  struct lru_stats st;
+  (void) userdata;
 
-  if (sftp_fstat ((struct sftp_fd *) fi->fh, buf) < 0)
+  if (NULL != block_cache)
     {
-      print_error ("sftp_fstat");
-      return -1;
+      block_cache_stats (block_cache, &st);
+      print_error ("block cache: %lu hits, %lu misses, %lu evictions",
+                   st.hits, st.misses, st.evictions);
+      block_cache_free (block_cache);
     }
-  return 0;
+  if (NULL != attr_cache)
+    {
+      struct lru_stats neg;
+      attr_cache_stats (attr_cache, &st, &neg);
+      print_error ("attr cache: %lu hits, %lu misses", st.hits, st.misses);
+      print_error ("negative cache: %lu hits, %lu misses", neg.hits,
+                   neg.misses);
+      attr_cache_free (attr_cache);
+    }
+  if (NULL != handle_cache)
+    {
+      handle_cache_stats (handle_cache, &st);
+      print_error ("handle cache: %lu hits, %lu misses, %lu evictions",
+                   st.hits, st.misses, st.evictions);
+      handle_cache_free (handle_cache);
+    }
+  if (NULL != disk_cache)
+    {
+      disk_cache_stats (disk_cache, &st);
+      print_error ("disk cache: %lu hits, %lu misses, %lu evictions",
+                   st.hits, st.misses, st.evictions);
+      disk_cache_close (disk_cache);
+    }
+  print_error ("inodes: %lu still known", inode_count (inodes));
+  sftp_tree_stats (sftp_context, DEBUGFP);
+  sftp_tree_destroy (sftp_context);
+  fclose (DEBUGFP);
 }
 
-static struct fuse_operations arsenal_oper = {
+static struct fuse_lowlevel_ops arsenal_oper = {
+  .init = arsenal_init,
+  .destroy = arsenal_destroy,
+  .lookup = arsenal_lookup,
+  .forget = arsenal_forget,
   .getattr = arsenal_getattr,
   .readlink = arsenal_readlink,
-  .getdir = NULL,
-  .mknod = NULL,
-  .mkdir = NULL,
-  .unlink = NULL,
-  .rmdir = NULL,
-  .symlink = NULL,
-  .rename = NULL,
-  .link = NULL,
-  .chmod = NULL,
-  .chown = NULL,
-  .truncate = NULL,
-  .utime = NULL,
   .open = arsenal_open,
   .read = arsenal_read,
-  .write = NULL,
-  .statfs = arsenal_statfs,
-  .flush = NULL,
   .release = arsenal_release,
-  .fsync = NULL,
-  .setxattr = NULL,
-  .getxattr = NULL,
-  .listxattr = NULL,
-  .removexattr = NULL,
   .opendir = arsenal_opendir,
   .readdir = arsenal_readdir,
   .releasedir = arsenal_releasedir,
-  .fsyncdir = NULL,
-  .init = arsenal_init,
-  .destroy = arsenal_destroy,
-  .access = NULL,
-  .create = NULL,
-  .ftruncate = NULL,
-  .fgetattr = arsenal_fgetattr,
-  .lock = NULL,
-  .utimens = NULL,
-  .bmap = NULL
+  .statfs = arsenal_statfs
 };
 
-void
-get_mount_point (int argc, char **argv)
-{
-  struct fuse_args argst = FUSE_ARGS_INIT (argc, argv);
-  fuse_parse_cmdline (&argst, &mount_point, NULL, NULL);
-}
-
 int
 main (int argc, char **argv)
 {
-  int ret;
   struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+  int multithreaded;
+  int foreground;
+  int ret = -1;
 
-  get_mount_point (argc, argv);
   memset (&options, 0, sizeof (struct options));
+  options.mem_cache_size = 64;
+  options.cache_size = 1024;
+  options.attr_cache_ttl = 2.0;
+  options.negative_ttl = 1.0;
+  options.handle_cache_size = 64;
+  options.handle_cache_ttl = 10.0;
+  options.prefetch_size = 128;
   if (-1 == fuse_opt_parse (&args, &options, arsenal_opts, NULL))
     return -1;
-  ret = fuse_main (args.argc, args.argv, &arsenal_oper, NULL);
+
+  if (-1 == fuse_parse_cmdline (&args, &mount_point, &multithreaded,
+                                &foreground))
+    goto exit;
+
+  if (NULL == (inodes = inode_table_new ()))
+    {
+      fprintf (stderr, "arsenal: out of memory\n");
+      goto exit;
+    }
+
+  if (NULL == (ch = fuse_mount (mount_point, &args)))
+    goto exit;
+
+  if (NULL != (se = fuse_lowlevel_new (&args, &arsenal_oper,
+                                       sizeof arsenal_oper, NULL)))
+    {
+      if (-1 != fuse_set_signal_handlers (se))
+        {
+          fuse_session_add_chan (se, ch);
+          fuse_daemonize (foreground);
+          ret = multithreaded ? fuse_session_loop_mt (se)
+                              : fuse_session_loop (se);
+          fuse_remove_signal_handlers (se);
+          fuse_session_remove_chan (ch);
+        }
+      fuse_session_destroy (se);
+    }
+  fuse_unmount (mount_point, ch);
+
+exit:
+  inode_table_free (inodes);
+  free (mount_point);
   fuse_opt_free_args (&args);
-  return ret;
+  return ret ? 1 : 0;
 }
@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <attr_cache.h>
+#include <lru.h>
+#include <debug.h>
+
+/* lstat results keyed by path. entries expire `ttl' seconds after they were
+ * stored, which bounds how long a change made on the server can go unseen.
+ * paths found not to exist are remembered separately for `negative_ttl'
+ * seconds, so probing for the same missing file over and over (include
+ * paths, module search paths) stays local. */
+
+#define ATTR_CACHE_SHARDS 16
+
+struct attr_cache
+{
+  struct lru *lru;
+  struct lru *negative;
+};
+
+struct attr_cache *
+attr_cache_new (double ttl, double negative_ttl, size_t budget)
+{
+  struct attr_cache *c;
+
+  if (NULL == (c = calloc (1, sizeof *c)))
+    {
+      print_error ("Out of memory");
+      return NULL;
+    }
+
+  /* a zero ttl would mean entries never expire, leave those out instead */
+  if ((0 < ttl && NULL == (c->lru = lru_new (ATTR_CACHE_SHARDS, budget, ttl)))
+      || (0 < negative_ttl
+          && NULL == (c->negative = lru_new (ATTR_CACHE_SHARDS, budget / 4,
+                                             negative_ttl))))
+    {
+      print_error ("lru_new");
+      attr_cache_free (c);
+      return NULL;
+    }
+
+  return c;
+}
+
+void
+attr_cache_free (struct attr_cache *c)
+{
+  if (NULL == c)
+    return;
+
+  lru_free (c->lru);
+  lru_free (c->negative);
+  free (c);
+}
+
+int
+attr_cache_get (struct attr_cache *c, const char *path, struct stat *buf)
+{
+  if (NULL == c || NULL == path || NULL == buf)
+    return -1;
+
+  if ((ssize_t) sizeof *buf != lru_get (c->lru, path, strlen (path), buf, 0,
+                                        sizeof *buf))
+    return -1;
+  return 0;
+}
+
+void
+attr_cache_put (struct attr_cache *c, const char *path, const struct stat *buf)
+{
+  if (NULL == c || NULL == path || NULL == buf)
+    return;
+
+  lru_remove (c->negative, path, strlen (path));
+  lru_put (c->lru, path, strlen (path), buf, sizeof *buf);
+}
+
+/* whether `path' was recently found not to exist */
+int
+attr_cache_missing (struct attr_cache *c, const char *path)
+{
+  if (NULL == c || NULL == path)
+    return 0;
+
+  return 0 <= lru_get (c->negative, path, strlen (path), NULL, 0, 0);
+}
+
+void
+attr_cache_put_missing (struct attr_cache *c, const char *path)
+{
+  if (NULL == c || NULL == path)
+    return;
+
+  lru_remove (c->lru, path, strlen (path));
+  lru_put (c->negative, path, strlen (path), NULL, 0);
+}
+
+void
+attr_cache_remove (struct attr_cache *c, const char *path)
+{
+  if (NULL == c || NULL == path)
+    return;
+
+  lru_remove (c->lru, path, strlen (path));
+  lru_remove (c->negative, path, strlen (path));
+}
+
+void
+attr_cache_stats (struct attr_cache *c, struct lru_stats *st,
+                  struct lru_stats *negative)
+{
+  lru_stats (NULL == c ? NULL : c->lru, st);
+  if (NULL != negative)
+    lru_stats (NULL == c ? NULL : c->negative, negative);
+}
@@ -0,0 +1,35 @@
+#ifndef _H_ATTR_CACHE
+#define _H_ATTR_CACHE
+
+#include <sys/stat.h>
+#include <lru.h>
+
+struct attr_cache;
+
+struct attr_cache *
+attr_cache_new (double ttl, double negative_ttl, size_t budget);
+
+void
+attr_cache_free (struct attr_cache *c);
+
+int
+attr_cache_get (struct attr_cache *c, const char *path, struct stat *buf);
+
+void
+attr_cache_put (struct attr_cache *c, const char *path,
+                const struct stat *buf);
+
+int
+attr_cache_missing (struct attr_cache *c, const char *path);
+
+void
+attr_cache_put_missing (struct attr_cache *c, const char *path);
+
+void
+attr_cache_remove (struct attr_cache *c, const char *path);
+
+void
+attr_cache_stats (struct attr_cache *c, struct lru_stats *st,
+                  struct lru_stats *negative);
+
+#endif
@@ -0,0 +1,367 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+#include <block_cache.h>
+#include <disk_cache.h>
+#include <lru.h>
+#include <debug.h>
+
+/* file data is cached in BLOCK_SIZE pieces. the key carries the remote size
+ * and mtime captured when the file was opened, so a changed file simply stops
+ * hitting its old blocks and they age out of the LRU. when a disk cache is
+ * attached it sits below the memory tier: memory misses are looked up there
+ * before going to the network, and blocks fetched remotely are stored in
+ * both. */
+
+#define BLOCK_CACHE_SHARDS 16
+
+struct block_cache
+{
+  struct lru *lru;
+  struct disk_cache *disk;
+};
+
+struct block_key
+{
+  uint64_t block;
+  uint64_t size;
+  int64_t mtime;
+  char path[PATH_MAX];
+};
+
+/* the most one block costs against the budget: its data, its key and what
+ * the LRU keeps beside them */
+#define BLOCK_CHARGE (BLOCK_SIZE + sizeof (struct block_key) + 256)
+
+static size_t
+block_key_init (struct block_key *k, const char *path, const struct stat *st,
+                uint64_t block)
+{
+  size_t len = strlen (path);
+
+  if (sizeof k->path <= len)
+    len = sizeof k->path - 1;
+
+  memset (k, 0, offsetof (struct block_key, path));
+  k->block = block;
+  k->size = st->st_size;
+  k->mtime = st->st_mtime;
+  memcpy (k->path, path, len);
+  return offsetof (struct block_key, path) + len;
+}
+
+struct block_cache *
+block_cache_new (size_t budget, struct disk_cache *disk)
+{
+  struct block_cache *c;
+  size_t nshards = BLOCK_CACHE_SHARDS;
+
+  if (NULL == (c = calloc (1, sizeof *c)))
+    {
+      print_error ("Out of memory");
+      return NULL;
+    }
+
+  /* every shard gets an equal slice of the budget and a slice too thin for
+   * one block caches nothing at all, so small budgets get fewer shards */
+  if (0 < budget && budget < nshards * BLOCK_CHARGE)
+    {
+      nshards = budget / BLOCK_CHARGE;
+      if (0 == nshards)
+        {
+          nshards = 1;
+          budget = BLOCK_CHARGE;
+        }
+      print_error ("Memory cache of %lu bytes in %lu shard(s)",
+                   (unsigned long) budget, (unsigned long) nshards);
+    }
+
+  if (0 < budget
+      && NULL == (c->lru = lru_new (nshards, budget, 0)))
+    {
+      print_error ("lru_new");
+      free (c);
+      return NULL;
+    }
+
+  c->disk = disk;
+  return c;
+}
+
+void
+block_cache_free (struct block_cache *c)
+{
+  if (NULL == c)
+    return;
+
+  lru_free (c->lru);
+  free (c);
+}
+
+/* what a read holds on to until block_read_free */
+struct block_pin
+{
+  void *mem;
+  int64_t disk;
+};
+
+struct block_read
+{
+  struct block_cache *c;
+  char *run;
+  size_t count;
+  size_t npins;
+  struct block_pin *pins;
+  struct block_piece piece[];
+};
+
+/* fetch blocks [first, first + count) from the server with a single fill
+ * into `run' and cache them. returns where the data ends, which is before
+ * the end of the run only at the end of the file, or -1. a fill that comes
+ * back short of both the run and the size the file was opened with is an
+ * error, nothing of it is cached: a short block is only ever the last one */
+static off_t
+fill_run (struct block_cache *c, const char *path, const struct stat *st,
+          uint64_t first, size_t count, char *run, block_fill_t fill,
+          void *ctx)
+{
+  off_t start = first * BLOCK_SIZE;
+  ssize_t got;
+  size_t i;
+
+  if ((got = fill (ctx, run, count * BLOCK_SIZE, start)) < 0)
+    {
+      print_error ("fill");
+      return -1;
+    }
+
+  if ((size_t) got < count * BLOCK_SIZE && start + got != st->st_size)
+    {
+      print_error ("Short fill at %lld: %ld of %lu bytes", (long long) start,
+                   (long) got, (unsigned long) (count * BLOCK_SIZE));
+      return -1;
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      struct block_key key;
+      size_t klen;
+      size_t len;
+
+      if ((size_t) got <= i * BLOCK_SIZE)
+        break;
+      len = got - i * BLOCK_SIZE < BLOCK_SIZE ? got - i * BLOCK_SIZE
+                                              : BLOCK_SIZE;
+      disk_cache_put (c->disk, path, st, first + i, run + i * BLOCK_SIZE,
+                      len);
+      klen = block_key_init (&key, path, st, first + i);
+      lru_put (c->lru, &key, klen, run + i * BLOCK_SIZE, len);
+    }
+
+  return start + got;
+}
+
+/* read [offset, offset + size) of the file through the cache. the data is
+ * not copied out, it is described by pieces pointing straight at cached
+ * blocks: pinned memory blocks, or pinned slots of the disk cache's data
+ * file. blocks found in neither are fetched together, each run of
+ * consecutive missing ones with a single fill which the sftp layer turns
+ * into one pipelined read, and the pieces point into that.
+ *
+ * the pieces stay valid until block_read_free. returns NULL on error */
+struct block_read *
+block_cache_read (struct block_cache *c, const char *path,
+                  const struct stat *st, size_t size, off_t offset,
+                  block_fill_t fill, void *ctx)
+{
+  struct block_read *r;
+  struct block_key key;
+  uint64_t index, first, nblocks, run_first = 0;
+  size_t run_count = 0;
+  off_t end;
+  size_t i;
+  int failed = 0;
+
+  if (NULL == path || NULL == st || NULL == fill)
+    {
+      print_error ("Invalid arguments");
+      return NULL;
+    }
+
+  end = offset + (off_t) size;
+  if (NULL != c)
+    end = end < st->st_size ? end : st->st_size;
+  first = offset / BLOCK_SIZE;
+  nblocks = offset < end ? (end - 1) / BLOCK_SIZE - first + 1 : 0;
+
+  if (NULL == (r = calloc (1, sizeof *r + nblocks * sizeof *r->piece)))
+    {
+      print_error ("Out of memory");
+      return NULL;
+    }
+  r->c = c;
+
+  if (0 == nblocks)
+    return r;
+
+  /* without a cache there is nothing to point at, just read */
+  if (NULL == c)
+    {
+      ssize_t got;
+      if (NULL == (r->run = malloc (size))
+          || (got = fill (ctx, r->run, size, offset)) < 0)
+        {
+          block_read_free (r);
+          return NULL;
+        }
+      r->piece[0].mem = r->run;
+      r->piece[0].fd = -1;
+      r->piece[0].len = got;
+      r->count = 0 < got;
+      return r;
+    }
+
+  if (NULL == (r->pins = calloc (nblocks, sizeof *r->pins)))
+    {
+      print_error ("Out of memory");
+      free (r);
+      return NULL;
+    }
+  r->npins = nblocks;
+
+  for (index = first;; index++)
+    {
+      off_t pos = index * BLOCK_SIZE;
+      size_t skip = pos < offset ? offset - pos : 0;
+      size_t want = BLOCK_SIZE - skip;
+      struct block_piece *p = &r->piece[index - first];
+      struct block_pin *pin = &r->pins[index - first];
+      const void *mem;
+      size_t len = 0;
+      size_t klen;
+
+      if (pos < end)
+        {
+          if (end - (pos + (off_t) skip) < (off_t) want)
+            want = end - (pos + skip);
+
+          p->fd = -1;
+          pin->disk = -1;
+          klen = block_key_init (&key, path, st, index);
+          if (NULL != (pin->mem = lru_pin (c->lru, &key, klen, &mem, &len)))
+            p->mem = (const char *) mem + skip;
+          else if (0 <= (pin->disk = disk_cache_pin (c->disk, path, st, index,
+                                                     &p->fd, &p->pos, &len)))
+            p->pos += skip;
+          else
+            {
+              /* missing, fetched along with its missing neighbours */
+              if (0 == run_count)
+                run_first = index;
+              run_count++;
+              p->len = want;
+              continue;
+            }
+
+          /* only the last block of the file may be short, one that is
+           * anywhere else does not belong to this file and is fetched
+           * again */
+          if (len < BLOCK_SIZE && pos + (off_t) len != st->st_size)
+            {
+              lru_unpin (c->lru, pin->mem);
+              disk_cache_unpin (c->disk, pin->disk);
+              pin->mem = NULL;
+              pin->disk = -1;
+              if (0 == run_count)
+                run_first = index;
+              run_count++;
+              p->len = want;
+              continue;
+            }
+
+          p->len = len > skip ? len - skip : 0;
+          if (p->len > want)
+            p->len = want;
+        }
+
+      /* a hit or the end of the range, fetch the run in front of it */
+      if (0 < run_count)
+        {
+          off_t got = -1;
+          char *run;
+
+          if (NULL == r->run && NULL == (r->run = malloc (nblocks
+                                                          * BLOCK_SIZE)))
+            {
+              print_error ("Out of memory");
+            }
+          else
+            {
+              run = r->run + (run_first - first) * BLOCK_SIZE;
+              got = fill_run (c, path, st, run_first, run_count, run, fill,
+                              ctx);
+              for (i = 0; i < run_count; i++)
+                {
+                  r->piece[run_first - first + i].mem = run + i * BLOCK_SIZE
+                    + (run_first + i == first ? offset - first * BLOCK_SIZE
+                                              : 0);
+                  r->piece[run_first - first + i].fd = -1;
+                }
+            }
+          if (got < 0)
+            failed = 1;
+          run_count = 0;
+        }
+
+      if (end <= pos || failed)
+        break;
+    }
+
+  /* the range was clipped to the size the file was opened with and every
+   * block in it is whole up to there, so the data ends where the range does.
+   * a fill that failed fails the read rather than cutting it short */
+  if (failed)
+    {
+      block_read_free (r);
+      return NULL;
+    }
+
+  r->count = nblocks;
+  return r;
+}
+
+const struct block_piece *
+block_read_pieces (struct block_read *r, size_t *count)
+{
+  *count = r->count;
+  return r->piece;
+}
+
+void
+block_read_free (struct block_read *r)
+{
+  size_t i;
+
+  if (NULL == r)
+    return;
+
+  for (i = 0; i < r->npins; i++)
+    {
+      lru_unpin (r->c->lru, r->pins[i].mem);
+      disk_cache_unpin (r->c->disk, r->pins[i].disk);
+    }
+  free (r->pins);
+  free (r->run);
+  free (r);
+}
+
+void
+block_cache_stats (struct block_cache *c, struct lru_stats *st)
+{
+  lru_stats (NULL == c ? NULL : c->lru, st);
+}
@@ -0,0 +1,47 @@
+#ifndef _H_BLOCK_CACHE
+#define _H_BLOCK_CACHE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <lru.h>
+#include <disk_cache.h>
+
+#define BLOCK_SIZE (128 * 1024)
+
+struct block_cache;
+struct block_read;
+
+/* part of the data of a read: `len' bytes at `mem', or, with `fd' not
+ * negative, at `pos' in the file `fd' */
+struct block_piece
+{
+  const char *mem;
+  int fd;
+  off_t pos;
+  size_t len;
+};
+
+typedef ssize_t (*block_fill_t) (void *ctx, char *buf, size_t size,
+                                 off_t offset);
+
+struct block_cache *
+block_cache_new (size_t budget, struct disk_cache *disk);
+
+void
+block_cache_free (struct block_cache *c);
+
+struct block_read *
+block_cache_read (struct block_cache *c, const char *path,
+                  const struct stat *st, size_t size, off_t offset,
+                  block_fill_t fill, void *ctx);
+
+const struct block_piece *
+block_read_pieces (struct block_read *r, size_t *count);
+
+void
+block_read_free (struct block_read *r);
+
+void
+block_cache_stats (struct block_cache *c, struct lru_stats *st);
+
+#endif
@@ -0,0 +1,532 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <disk_cache.h>
+#include <debug.h>
+
+/* persistent block cache kept in a local directory.
+ *
+ *   data   nslots * block_size bytes, slot i holds one block at i * block_size
+ *   index  a header followed by one struct disk_slot per data slot
+ *
+ * the index is mmap'd shared so it is written back by the kernel and survives
+ * a remount. slots carry the remote size/mtime of the file they came from and
+ * are dropped as soon as a lookup presents different ones. the header's
+ * `clean' flag is only set after a full sync at shutdown; a cache that was not
+ * closed cleanly is wiped on the next open rather than trusted.
+ *
+ * the path -> slot hash table and clock eviction state live in memory and are
+ * rebuilt from the index on open. */
+
+#define DISK_CACHE_MAGIC 0x48434c4e53524141ULL
+#define DISK_CACHE_VERSION 1
+
+struct disk_header
+{
+  uint64_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  uint64_t nslots;
+  uint64_t clean;
+};
+
+struct disk_slot
+{
+  uint64_t path_hash;
+  uint64_t path_check;
+  uint64_t block;
+  uint64_t size;
+  int64_t mtime;
+  uint32_t len;
+  uint32_t valid;
+};
+
+struct disk_cache
+{
+  pthread_mutex_t mutex;
+  int index_fd;
+  int data_fd;
+  struct disk_header *header;
+  struct disk_slot *slots;
+  size_t map_size;
+  uint32_t nslots;
+  size_t block_size;
+
+  uint32_t *buckets;
+  uint32_t *chain;
+  unsigned char *referenced;
+  /* slots being written, or pinned by readers, are never recycled */
+  uint32_t *busy;
+  uint32_t nbuckets;
+  uint32_t hand;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t entries;
+  uint64_t bytes;
+};
+
+/* chain links are stored as slot + 1 so that 0 can mean "none" */
+#define NIL 0
+
+static uint64_t
+hash_path (const char *path, uint64_t seed)
+{
+  uint64_t h = seed;
+
+  for (; '\0' != *path; path++)
+    {
+      h ^= (unsigned char) *path;
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+static uint32_t
+bucket_of (struct disk_cache *c, uint64_t path_hash, uint64_t block)
+{
+  uint64_t h = path_hash ^ (block * 0x9e3779b97f4a7c15ULL);
+  h ^= h >> 29;
+  return h & (c->nbuckets - 1);
+}
+
+static void
+table_insert (struct disk_cache *c, uint32_t i)
+{
+  uint32_t b = bucket_of (c, c->slots[i].path_hash, c->slots[i].block);
+  c->chain[i] = c->buckets[b];
+  c->buckets[b] = i + 1;
+}
+
+static void
+table_remove (struct disk_cache *c, uint32_t i)
+{
+  uint32_t *p = &c->buckets[bucket_of (c, c->slots[i].path_hash,
+                                       c->slots[i].block)];
+
+  for (; NIL != *p; p = &c->chain[*p - 1])
+    if (*p - 1 == i)
+      {
+        *p = c->chain[i];
+        c->chain[i] = NIL;
+        return;
+      }
+}
+
+static int64_t
+table_find (struct disk_cache *c, uint64_t path_hash, uint64_t path_check,
+            uint64_t block)
+{
+  uint32_t n;
+
+  for (n = c->buckets[bucket_of (c, path_hash, block)]; NIL != n;
+       n = c->chain[n - 1])
+    {
+      struct disk_slot *slot = &c->slots[n - 1];
+      if (slot->path_hash == path_hash && slot->path_check == path_check
+          && slot->block == block)
+        return n - 1;
+    }
+  return -1;
+}
+
+static void
+slot_release (struct disk_cache *c, uint32_t i)
+{
+  table_remove (c, i);
+  c->entries--;
+  c->bytes -= c->slots[i].len;
+  c->slots[i].valid = 0;
+}
+
+/* second chance clock over the slots. returns -1 only if every slot is in the
+ * middle of being written. */
+static int64_t
+slot_victim (struct disk_cache *c)
+{
+  uint64_t n;
+
+  for (n = 0; n < 2 * (uint64_t) c->nslots + 1; n++)
+    {
+      uint32_t i = c->hand++ % c->nslots;
+
+      if (c->busy[i])
+        continue;
+      if (!c->slots[i].valid)
+        return i;
+      if (c->referenced[i])
+        {
+          c->referenced[i] = 0;
+          continue;
+        }
+      slot_release (c, i);
+      c->evictions++;
+      return i;
+    }
+  return -1;
+}
+
+static int
+open_files (struct disk_cache *c, const char *dir)
+{
+  char path[PATH_MAX];
+
+  if (mkdir (dir, 0700) < 0 && EEXIST != errno)
+    {
+      print_error ("mkdir `%s': %s", dir, strerror (errno));
+      return -1;
+    }
+
+  snprintf (path, sizeof path, "%s/index", dir);
+  if ((c->index_fd = open (path, O_RDWR | O_CREAT, 0600)) < 0)
+    {
+      print_error ("open `%s': %s", path, strerror (errno));
+      return -1;
+    }
+
+  /* two mounts sharing one cache directory would corrupt each other */
+  if (flock (c->index_fd, LOCK_EX | LOCK_NB) < 0)
+    {
+      print_error ("`%s' is in use by another mount", dir);
+      return -1;
+    }
+
+  snprintf (path, sizeof path, "%s/data", dir);
+  if ((c->data_fd = open (path, O_RDWR | O_CREAT, 0600)) < 0)
+    {
+      print_error ("open `%s': %s", path, strerror (errno));
+      return -1;
+    }
+
+  return 0;
+}
+
+static int
+map_index (struct disk_cache *c)
+{
+  struct stat st;
+  struct disk_header *h;
+  uint32_t i;
+
+  c->map_size = sizeof *h + (size_t) c->nslots * sizeof *c->slots;
+
+  if (fstat (c->index_fd, &st) < 0)
+    {
+      print_error ("fstat: %s", strerror (errno));
+      return -1;
+    }
+
+  if ((size_t) st.st_size != c->map_size
+      && (ftruncate (c->index_fd, 0) < 0
+          || ftruncate (c->index_fd, c->map_size) < 0))
+    {
+      print_error ("ftruncate: %s", strerror (errno));
+      return -1;
+    }
+
+  if (MAP_FAILED == (h = mmap (NULL, c->map_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED, c->index_fd, 0)))
+    {
+      print_error ("mmap: %s", strerror (errno));
+      return -1;
+    }
+
+  c->header = h;
+  c->slots = (struct disk_slot *) (h + 1);
+
+  if (DISK_CACHE_MAGIC != h->magic || DISK_CACHE_VERSION != h->version
+      || c->block_size != h->block_size || c->nslots != h->nslots
+      || !h->clean)
+    {
+      print_error ("Starting with an empty disk cache");
+      memset (c->slots, 0, (size_t) c->nslots * sizeof *c->slots);
+      h->magic = DISK_CACHE_MAGIC;
+      h->version = DISK_CACHE_VERSION;
+      h->block_size = c->block_size;
+      h->nslots = c->nslots;
+    }
+
+  /* until we shut down cleanly the data file may lag behind the index */
+  h->clean = 0;
+  if (msync (h, sizeof *h, MS_SYNC) < 0)
+    print_error ("msync: %s", strerror (errno));
+
+  for (i = 0; i < c->nslots; i++)
+    {
+      struct disk_slot *slot = &c->slots[i];
+      if (!slot->valid)
+        continue;
+      if (c->block_size < slot->len)
+        {
+          slot->valid = 0;
+          continue;
+        }
+      table_insert (c, i);
+      c->entries++;
+      c->bytes += slot->len;
+    }
+
+  return 0;
+}
+
+struct disk_cache *
+disk_cache_open (const char *dir, size_t budget, size_t block_size)
+{
+  struct disk_cache *c;
+  struct stat st;
+  uint64_t nslots;
+
+  if (NULL == dir || 0 == block_size)
+    {
+      print_error ("Invalid arguments");
+      return NULL;
+    }
+
+  nslots = budget / block_size;
+  if (0 == nslots || UINT32_MAX <= nslots)
+    {
+      print_error ("Invalid disk cache size %zu", budget);
+      return NULL;
+    }
+
+  if (NULL == (c = calloc (1, sizeof *c)))
+    {
+      print_error ("Out of memory");
+      return NULL;
+    }
+
+  c->index_fd = c->data_fd = -1;
+  c->nslots = nslots;
+  c->block_size = block_size;
+  for (c->nbuckets = 1; c->nbuckets < c->nslots; c->nbuckets <<= 1);
+
+  if (NULL == (c->buckets = calloc (c->nbuckets, sizeof *c->buckets))
+      || NULL == (c->chain = calloc (c->nslots, sizeof *c->chain))
+      || NULL == (c->referenced = calloc (c->nslots, 1))
+      || NULL == (c->busy = calloc (c->nslots, sizeof *c->busy)))
+    {
+      print_error ("Out of memory");
+      goto error;
+    }
+
+  if (open_files (c, dir) < 0 || map_index (c) < 0)
+    goto error;
+
+  if (fstat (c->data_fd, &st) < 0
+      || ((uint64_t) st.st_size != nslots * block_size
+          && ftruncate (c->data_fd, nslots * block_size) < 0))
+    {
+      print_error ("data file: %s", strerror (errno));
+      goto error;
+    }
+
+  pthread_mutex_init (&c->mutex, NULL);
+  print_error ("Disk cache `%s': %lu of %u slots in use", dir, c->entries,
+               c->nslots);
+  return c;
+
+error:
+  if (NULL != c->header)
+    munmap (c->header, c->map_size);
+  if (0 <= c->index_fd)
+    close (c->index_fd);
+  if (0 <= c->data_fd)
+    close (c->data_fd);
+  free (c->buckets);
+  free (c->chain);
+  free (c->referenced);
+  free (c->busy);
+  free (c);
+  return NULL;
+}
+
+void
+disk_cache_close (struct disk_cache *c)
+{
+  if (NULL == c)
+    return;
+
+  /* data first, then the index, and only then mark the cache trustworthy */
+  if (fdatasync (c->data_fd) < 0
+      || msync (c->header, c->map_size, MS_SYNC) < 0)
+    {
+      print_error ("sync: %s", strerror (errno));
+    }
+  else
+    {
+      c->header->clean = 1;
+      if (msync (c->header, sizeof *c->header, MS_SYNC) < 0)
+        print_error ("msync: %s", strerror (errno));
+    }
+
+  munmap (c->header, c->map_size);
+  close (c->data_fd);
+  close (c->index_fd);
+  pthread_mutex_destroy (&c->mutex);
+  free (c->buckets);
+  free (c->chain);
+  free (c->referenced);
+  free (c->busy);
+  free (c);
+}
+
+/* whether a block of `len' bytes is all of block `block' of a file of `size'
+ * bytes: only the last block of a file may be short */
+static int
+block_whole (struct disk_cache *c, uint64_t block, size_t len, uint64_t size)
+{
+  return c->block_size == len || block * c->block_size + len == size;
+}
+
+/* find `block' and keep its slot from being recycled until disk_cache_unpin,
+ * so that it can be read straight from `fd' at `pos'. returns the slot or
+ * -1 on a miss */
+int64_t
+disk_cache_pin (struct disk_cache *c, const char *path, const struct stat *st,
+                uint64_t block, int *fd, off_t *pos, size_t *len)
+{
+  uint64_t path_hash, path_check;
+  int64_t i;
+
+  if (NULL == c || NULL == path || NULL == st || NULL == fd || NULL == pos
+      || NULL == len)
+    return -1;
+
+  path_hash = hash_path (path, 14695981039346656037ULL);
+  path_check = hash_path (path, 0x84222325cbf29ce4ULL);
+
+  pthread_mutex_lock (&c->mutex);
+  if ((i = table_find (c, path_hash, path_check, block)) < 0)
+    {
+      c->misses++;
+      goto exit;
+    }
+
+  /* the remote file changed since this block was stored, or it was stored
+   * truncated */
+  if ((uint64_t) st->st_size != c->slots[i].size
+      || (int64_t) st->st_mtime != c->slots[i].mtime
+      || !block_whole (c, block, c->slots[i].len, c->slots[i].size))
+    {
+      slot_release (c, i);
+      c->misses++;
+      i = -1;
+      goto exit;
+    }
+
+  c->referenced[i] = 1;
+  c->busy[i]++;
+  c->hits++;
+  *fd = c->data_fd;
+  *pos = (off_t) i * c->block_size;
+  *len = c->slots[i].len;
+exit:
+  pthread_mutex_unlock (&c->mutex);
+  return i;
+}
+
+void
+disk_cache_unpin (struct disk_cache *c, int64_t slot)
+{
+  if (NULL == c || slot < 0)
+    return;
+
+  pthread_mutex_lock (&c->mutex);
+  c->busy[slot]--;
+  pthread_mutex_unlock (&c->mutex);
+}
+
+int
+disk_cache_put (struct disk_cache *c, const char *path, const struct stat *st,
+                uint64_t block, const char *buf, size_t len)
+{
+  uint64_t path_hash, path_check;
+  int64_t i, old;
+
+  if (NULL == c || NULL == path || NULL == st || NULL == buf
+      || c->block_size < len)
+    return -1;
+
+  /* a truncated block would outlive this mount */
+  if (!block_whole (c, block, len, st->st_size))
+    {
+      print_error ("Short block %llu: %lu bytes", (unsigned long long) block,
+                   (unsigned long) len);
+      return -1;
+    }
+
+  path_hash = hash_path (path, 14695981039346656037ULL);
+  path_check = hash_path (path, 0x84222325cbf29ce4ULL);
+
+  pthread_mutex_lock (&c->mutex);
+  if ((i = slot_victim (c)) < 0)
+    {
+      pthread_mutex_unlock (&c->mutex);
+      return -1;
+    }
+  c->busy[i]++;
+  pthread_mutex_unlock (&c->mutex);
+
+  if ((ssize_t) len != pwrite (c->data_fd, buf, len,
+                               (off_t) i * c->block_size))
+    {
+      print_error ("pwrite: %s", strerror (errno));
+      pthread_mutex_lock (&c->mutex);
+      c->busy[i]--;
+      pthread_mutex_unlock (&c->mutex);
+      return -1;
+    }
+
+  pthread_mutex_lock (&c->mutex);
+  c->busy[i]--;
+
+  /* someone else stored the same block in the meantime */
+  if (0 <= (old = table_find (c, path_hash, path_check, block)))
+    slot_release (c, old);
+
+  c->slots[i].path_hash = path_hash;
+  c->slots[i].path_check = path_check;
+  c->slots[i].block = block;
+  c->slots[i].size = st->st_size;
+  c->slots[i].mtime = st->st_mtime;
+  c->slots[i].len = len;
+  c->slots[i].valid = 1;
+  table_insert (c, i);
+  c->referenced[i] = 1;
+  c->entries++;
+  c->bytes += len;
+  pthread_mutex_unlock (&c->mutex);
+  return 0;
+}
+
+void
+disk_cache_stats (struct disk_cache *c, struct lru_stats *st)
+{
+  memset (st, 0, sizeof *st);
+  if (NULL == c)
+    return;
+
+  pthread_mutex_lock (&c->mutex);
+  st->hits = c->hits;
+  st->misses = c->misses;
+  st->evictions = c->evictions;
+  st->entries = c->entries;
+  st->bytes = c->bytes;
+  pthread_mutex_unlock (&c->mutex);
+}
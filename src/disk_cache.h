@@ -0,0 +1,31 @@
+#ifndef _H_DISK_CACHE
+#define _H_DISK_CACHE
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <lru.h>
+
+struct disk_cache;
+
+struct disk_cache *
+disk_cache_open (const char *dir, size_t budget, size_t block_size);
+
+void
+disk_cache_close (struct disk_cache *c);
+
+int64_t
+disk_cache_pin (struct disk_cache *c, const char *path, const struct stat *st,
+                uint64_t block, int *fd, off_t *pos, size_t *len);
+
+void
+disk_cache_unpin (struct disk_cache *c, int64_t slot);
+
+int
+disk_cache_put (struct disk_cache *c, const char *path, const struct stat *st,
+                uint64_t block, const char *buf, size_t len);
+
+void
+disk_cache_stats (struct disk_cache *c, struct lru_stats *st);
+
+#endif
@@ -0,0 +1,537 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <engine.h>
+#include <debug.h>
+
+/* an event loop driving the ssh sessions of one volume in non-blocking mode.
+ *
+ * callers hand a session (a channel here) a step: a function making one
+ * non-blocking libssh2 call. the loop runs the step and, for as long as it
+ * returns LIBSSH2_ERROR_EAGAIN, parks the channel on epoll in whatever
+ * direction libssh2 is waiting for and runs the step again once the socket
+ * is ready. the caller sleeps until its step has returned anything else.
+ *
+ * a session is split into lanes, one per sftp channel opened on it. libssh2
+ * keeps the state of an unfinished sftp call in its sftp channel, so a lane
+ * works on one step at a time and the rest queue up behind it in order, but
+ * the lanes of a session are independent: the loop runs the head step of
+ * every lane in turn, and the requests of different lanes are in flight on
+ * the one socket at the same time. a session waits on epoll only once none
+ * of its lanes can get any further.
+ *
+ * two things about sharing a transport between lanes. a lane's step can read
+ * the reply another lane is waiting for off the socket, which is then queued
+ * in the session where epoll will not see it, so before parking the lanes
+ * are asked whether anything arrived for them. and a packet libssh2 could
+ * only send part of must be finished by the very call that started it, so a
+ * lane blocked on sending has the session to itself until it is through.
+ *
+ * every volume runs a loop of its own so the crypto for different servers
+ * does not share one thread. */
+
+struct engine_req
+{
+  long (*step) (void *);
+  void *arg;
+  long result;
+  int done;
+  pthread_cond_t cond;
+  struct engine_req *next;
+};
+
+struct engine_lane
+{
+  /* requests in order, the head is the one being run */
+  struct engine_req *head;
+  struct engine_req *tail;
+  size_t pending;
+
+  /* the ssh channel under the lane's sftp channel, see chan_readable */
+  LIBSSH2_CHANNEL *channel;
+};
+
+struct engine_chan
+{
+  struct engine *e;
+  int fd;
+  LIBSSH2_SESSION *session;
+
+  struct engine_lane *lanes;
+  size_t nlanes;
+  size_t pending;
+
+  /* the lane in the middle of sending a packet, if any */
+  struct engine_lane *sending;
+
+  /* parked on epoll, or queued to be run */
+  int waiting;
+  int runnable;
+  struct engine_chan *next_runnable;
+
+  /* the socket could not be waited on, every request fails from then on */
+  int broken;
+
+  /* without an engine, calls are made right away one at a time */
+  pthread_mutex_t mutex;
+};
+
+struct engine
+{
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  int epfd;
+  int evfd;
+  struct engine_chan *runnable;
+  int stop;
+};
+
+#define ENGINE_EVENTS 64
+
+/* the caller must hold e->mutex */
+static int
+chan_schedule (struct engine_chan *c)
+{
+  struct engine *e = c->e;
+
+  if (c->waiting || c->runnable || 0 == c->pending)
+    return 0;
+
+  c->runnable = 1;
+  c->next_runnable = e->runnable;
+  e->runnable = c;
+  return 1;
+}
+
+/* hand the head request of `l' its result. the caller must hold e->mutex */
+static void
+lane_finish (struct engine_chan *c, struct engine_lane *l, long result)
+{
+  struct engine_req *r = l->head;
+
+  l->head = r->next;
+  if (NULL == l->head)
+    l->tail = NULL;
+  l->pending--;
+  c->pending--;
+
+  r->result = result;
+  r->done = 1;
+  pthread_cond_signal (&r->cond);
+}
+
+/* fail every request queued on `c'. the caller must hold e->mutex */
+static void
+chan_fail (struct engine_chan *c)
+{
+  size_t i;
+
+  c->broken = 1;
+  c->sending = NULL;
+  for (i = 0; i < c->nlanes; i++)
+    while (NULL != c->lanes[i].head)
+      lane_finish (c, &c->lanes[i], LIBSSH2_ERROR_SOCKET_NONE);
+}
+
+/* wait for the socket in directions `dirs'. the caller must hold
+ * e->mutex */
+static void
+chan_park (struct engine_chan *c, int dirs)
+{
+  struct epoll_event ev;
+
+  memset (&ev, 0, sizeof ev);
+  ev.events = EPOLLONESHOT;
+  if (dirs & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+    ev.events |= EPOLLOUT;
+  if ((dirs & LIBSSH2_SESSION_BLOCK_INBOUND) || !(ev.events & EPOLLOUT))
+    ev.events |= EPOLLIN;
+  ev.data.ptr = c;
+
+  if (epoll_ctl (c->e->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+    {
+      /* without a way to wait, retrying would only spin */
+      print_error ("epoll_ctl: %s", strerror (errno));
+      chan_fail (c);
+      return;
+    }
+  c->waiting = 1;
+}
+
+/* whether data for a lane with a request waiting has been read off the
+ * socket already. the caller must hold e->mutex */
+static int
+chan_readable (struct engine_chan *c)
+{
+  size_t i;
+
+  for (i = 0; i < c->nlanes; i++)
+    if (NULL != c->lanes[i].head && NULL != c->lanes[i].channel
+        && libssh2_poll_channel_read (c->lanes[i].channel, 0))
+      return 1;
+  return 0;
+}
+
+/* run the steps of `l' until one has to wait, returning the directions it
+ * waits in, 0 once the lane is empty. `progress' is set if any step
+ * finished. the caller must hold e->mutex */
+static int
+lane_run (struct engine_chan *c, struct engine_lane *l, int *progress)
+{
+  struct engine *e = c->e;
+  struct engine_req *r;
+  long result;
+  int dirs = 0;
+
+  while (NULL != (r = l->head))
+    {
+      pthread_mutex_unlock (&e->mutex);
+      result = r->step (r->arg);
+      if (LIBSSH2_ERROR_EAGAIN == result)
+        dirs = libssh2_session_block_directions (c->session);
+      pthread_mutex_lock (&e->mutex);
+
+      if (LIBSSH2_ERROR_EAGAIN == result)
+        return dirs ? dirs : LIBSSH2_SESSION_BLOCK_INBOUND;
+
+      lane_finish (c, l, result);
+      *progress = 1;
+    }
+  return 0;
+}
+
+/* run the lanes of `c' until none of them can get further. the caller must
+ * hold e->mutex */
+static void
+chan_run (struct engine_chan *c)
+{
+  int progress;
+  int rerun = 0;
+  int dirs;
+  int d;
+  size_t i;
+
+  for (;;)
+    {
+      progress = 0;
+      dirs = 0;
+
+      if (NULL != c->sending)
+        {
+          d = lane_run (c, c->sending, &progress);
+          if (d & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+            {
+              chan_park (c, d);
+              return;
+            }
+          c->sending = NULL;
+        }
+
+      for (i = 0; i < c->nlanes; i++)
+        {
+          if (0 == (d = lane_run (c, &c->lanes[i], &progress)))
+            continue;
+          dirs |= d;
+          if (d & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+            {
+              c->sending = &c->lanes[i];
+              break;
+            }
+        }
+
+      /* every lane is empty */
+      if (0 == dirs)
+        return;
+
+      /* a step that finished may have read replies for lanes run before it
+       * off the socket, so go round again. without progress one more pass
+       * for data read already is enough, what a lane leaves unread is not
+       * what it waits for */
+      if (NULL == c->sending)
+        {
+          if (progress)
+            {
+              rerun = 0;
+              continue;
+            }
+          if (!rerun && chan_readable (c))
+            {
+              rerun = 1;
+              continue;
+            }
+        }
+
+      chan_park (c, dirs);
+      return;
+    }
+}
+
+static void *
+engine_loop (void *arg)
+{
+  struct engine *e = arg;
+  struct epoll_event events[ENGINE_EVENTS];
+  struct engine_chan *c;
+  uint64_t count;
+  int n;
+  int i;
+
+  pthread_mutex_lock (&e->mutex);
+  while (!e->stop)
+    {
+      while (NULL != (c = e->runnable))
+        {
+          /* still marked runnable while it runs, requests queued meanwhile
+           * are picked up by chan_run itself */
+          e->runnable = c->next_runnable;
+          chan_run (c);
+          c->runnable = 0;
+          chan_schedule (c);
+        }
+
+      pthread_mutex_unlock (&e->mutex);
+      n = epoll_wait (e->epfd, events, ENGINE_EVENTS, -1);
+      pthread_mutex_lock (&e->mutex);
+
+      if (n < 0 && EINTR != errno)
+        print_error ("epoll_wait: %s", strerror (errno));
+
+      for (i = 0; i < n; i++)
+        {
+          /* new requests, picked up from the runnable list */
+          if (NULL == (c = events[i].data.ptr))
+            {
+              if (read (e->evfd, &count, sizeof count) < 0 && EAGAIN != errno)
+                print_error ("read: %s", strerror (errno));
+              continue;
+            }
+
+          c->waiting = 0;
+          chan_schedule (c);
+        }
+    }
+  pthread_mutex_unlock (&e->mutex);
+  return NULL;
+}
+
+static void
+engine_wake (struct engine *e)
+{
+  uint64_t one = 1;
+
+  if (write (e->evfd, &one, sizeof one) < 0 && EAGAIN != errno)
+    print_error ("write: %s", strerror (errno));
+}
+
+struct engine *
+engine_new (void)
+{
+  struct engine *e;
+  struct epoll_event ev;
+  int err;
+
+  if (NULL == (e = calloc (1, sizeof *e)))
+    {
+      print_error ("Out of memory");
+      return NULL;
+    }
+
+  e->epfd = e->evfd = -1;
+  if ((e->epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0
+      || (e->evfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+      print_error ("%s", strerror (errno));
+      goto error;
+    }
+
+  memset (&ev, 0, sizeof ev);
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl (e->epfd, EPOLL_CTL_ADD, e->evfd, &ev) < 0)
+    {
+      print_error ("epoll_ctl: %s", strerror (errno));
+      goto error;
+    }
+
+  pthread_mutex_init (&e->mutex, NULL);
+  if (0 != (err = pthread_create (&e->thread, NULL, engine_loop, e)))
+    {
+      print_error ("pthread_create: %s", strerror (err));
+      pthread_mutex_destroy (&e->mutex);
+      goto error;
+    }
+
+  return e;
+
+error:
+  if (0 <= e->evfd)
+    close (e->evfd);
+  if (0 <= e->epfd)
+    close (e->epfd);
+  free (e);
+  return NULL;
+}
+
+void
+engine_free (struct engine *e)
+{
+  if (NULL == e)
+    return;
+
+  pthread_mutex_lock (&e->mutex);
+  e->stop = 1;
+  pthread_mutex_unlock (&e->mutex);
+  engine_wake (e);
+  pthread_join (e->thread, NULL);
+
+  pthread_mutex_destroy (&e->mutex);
+  close (e->evfd);
+  close (e->epfd);
+  free (e);
+}
+
+/* put the session on socket `fd' under the control of `e', with a lane for
+ * each of the `nlanes' ssh channels its sftp channels run on. the session
+ * must already be in non-blocking mode. with `e' NULL it stays blocking and
+ * calls are simply made one after another, whatever their lane */
+struct engine_chan *
+engine_attach (struct engine *e, int fd, LIBSSH2_SESSION *session,
+               LIBSSH2_CHANNEL **lanes, size_t nlanes)
+{
+  struct engine_chan *c;
+  struct epoll_event ev;
+  size_t i;
+
+  if (NULL == (c = calloc (1, sizeof *c))
+      || NULL == (c->lanes = calloc (nlanes ? nlanes : 1, sizeof *c->lanes)))
+    {
+      print_error ("Out of memory");
+      free (c);
+      return NULL;
+    }
+
+  c->e = e;
+  c->fd = fd;
+  c->session = session;
+  c->nlanes = nlanes;
+  for (i = 0; i < nlanes; i++)
+    c->lanes[i].channel = NULL == lanes ? NULL : lanes[i];
+  pthread_mutex_init (&c->mutex, NULL);
+
+  if (NULL == e)
+    return c;
+
+  /* registered disarmed, chan_park arms it when there is something to wait
+   * for */
+  memset (&ev, 0, sizeof ev);
+  ev.events = EPOLLONESHOT;
+  ev.data.ptr = c;
+  if (epoll_ctl (e->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+      print_error ("epoll_ctl: %s", strerror (errno));
+      pthread_mutex_destroy (&c->mutex);
+      free (c->lanes);
+      free (c);
+      return NULL;
+    }
+
+  return c;
+}
+
+/* the channel must be idle */
+void
+engine_detach (struct engine_chan *c)
+{
+  if (NULL == c)
+    return;
+
+  if (NULL != c->e)
+    {
+      pthread_mutex_lock (&c->e->mutex);
+      if (epoll_ctl (c->e->epfd, EPOLL_CTL_DEL, c->fd, NULL) < 0)
+        print_error ("epoll_ctl: %s", strerror (errno));
+      pthread_mutex_unlock (&c->e->mutex);
+    }
+
+  pthread_mutex_destroy (&c->mutex);
+  free (c->lanes);
+  free (c);
+}
+
+/* run `step' (arg) on lane `lane' of the channel's session until it stops
+ * asking to be retried and return what it returned last */
+long
+engine_call (struct engine_chan *c, size_t lane, long (*step) (void *),
+             void *arg)
+{
+  struct engine *e;
+  struct engine_lane *l;
+  struct engine_req r;
+  long result;
+  int wake;
+
+  if (NULL == c || c->nlanes <= lane || NULL == step)
+    {
+      print_error ("Invalid arguments");
+      return -1;
+    }
+
+  if (NULL == (e = c->e))
+    {
+      pthread_mutex_lock (&c->mutex);
+      while (LIBSSH2_ERROR_EAGAIN == (result = step (arg)));
+      pthread_mutex_unlock (&c->mutex);
+      return result;
+    }
+
+  r.step = step;
+  r.arg = arg;
+  r.done = 0;
+  r.next = NULL;
+  pthread_cond_init (&r.cond, NULL);
+
+  l = &c->lanes[lane];
+  pthread_mutex_lock (&e->mutex);
+  if (c->broken)
+    {
+      pthread_mutex_unlock (&e->mutex);
+      pthread_cond_destroy (&r.cond);
+      return LIBSSH2_ERROR_SOCKET_NONE;
+    }
+  if (NULL == l->tail)
+    l->head = &r;
+  else
+    l->tail->next = &r;
+  l->tail = &r;
+  l->pending++;
+  c->pending++;
+  wake = chan_schedule (c);
+  pthread_mutex_unlock (&e->mutex);
+
+  if (wake)
+    engine_wake (e);
+
+  pthread_mutex_lock (&e->mutex);
+  while (!r.done)
+    pthread_cond_wait (&r.cond, &e->mutex);
+  pthread_mutex_unlock (&e->mutex);
+
+  pthread_cond_destroy (&r.cond);
+  return r.result;
+}
+
+/* how many requests are queued on lane `lane' of the channel, a measure of
+ * how busy it is */
+size_t
+engine_pending (struct engine_chan *c, size_t lane)
+{
+  return NULL == c || c->nlanes <= lane ? 0 : c->lanes[lane].pending;
+}
@@ -0,0 +1,30 @@
+#ifndef _H_ENGINE
+#define _H_ENGINE
+
+#include <stdlib.h>
+#include <libssh2.h>
+
+struct engine;
+struct engine_chan;
+
+struct engine *
+engine_new (void);
+
+void
+engine_free (struct engine *e);
+
+struct engine_chan *
+engine_attach (struct engine *e, int fd, LIBSSH2_SESSION *session,
+               LIBSSH2_CHANNEL **lanes, size_t nlanes);
+
+void
+engine_detach (struct engine_chan *c);
+
+long
+engine_call (struct engine_chan *c, size_t lane, long (*step) (void *),
+             void *arg);
+
+size_t
+engine_pending (struct engine_chan *c, size_t lane);
+
+#endif
@@ -0,0 +1,389 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <time.h>
+
+#include <handle_cache.h>
+#include <debug.h>
+
+/* open files nobody is using any more, kept for the next open of the same
+ * path. opening a remote file costs a round trip or more (under a distribute
+ * node, one per child probed) and closing it another, which adds up for
+ * programs that open, read and close the same small files over and over.
+ *
+ * a parked handle remembers the attributes its file had when it was opened
+ * and is only handed out again to a caller that sees the same size and
+ * mtime, so a file changed on the server gets opened afresh. at most `max'
+ * handles are parked, the one idle the longest is closed to make room, and
+ * a reaper thread closes any left idle for `ttl' seconds. handles are closed
+ * through the callback given to handle_cache_new, never under the lock. */
+
+struct parked
+{
+  struct parked *chain;
+  struct parked *newer;
+  struct parked *older;
+  uint64_t hash;
+  uint64_t stamp;
+  void *handle;
+  struct stat st;
+  char path[];
+};
+
+struct handle_cache
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t reaper;
+  void (*close) (void *);
+  size_t max;
+  uint64_t ttl;
+
+  /* hashed by path, several handles on one path share a bucket. idle order
+   * runs from `newest' to `oldest' */
+  struct parked **buckets;
+  size_t nbuckets;
+  struct parked *newest;
+  struct parked *oldest;
+  size_t count;
+  int stop;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+static uint64_t
+hash_path (const char *path)
+{
+  const unsigned char *p = (const unsigned char *) path;
+  uint64_t h = 14695981039346656037ULL;
+
+  for (; '\0' != *p; p++)
+    {
+      h ^= *p;
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* take `p' out of the cache. the caller must hold c->mutex */
+static void
+unlink_parked (struct handle_cache *c, struct parked *p)
+{
+  struct parked **b;
+
+  for (b = &c->buckets[p->hash & (c->nbuckets - 1)]; *b != p;
+       b = &(*b)->chain);
+  *b = p->chain;
+
+  if (NULL == p->newer)
+    c->newest = p->older;
+  else
+    p->newer->older = p->older;
+  if (NULL == p->older)
+    c->oldest = p->newer;
+  else
+    p->older->newer = p->newer;
+
+  c->count--;
+}
+
+/* close the handles on a list made of `chain' links */
+static void
+close_all (struct handle_cache *c, struct parked *p)
+{
+  struct parked *next;
+
+  for (; NULL != p; p = next)
+    {
+      next = p->chain;
+      c->close (p->handle);
+      free (p);
+    }
+}
+
+static void *
+reaper_loop (void *arg)
+{
+  struct handle_cache *c = arg;
+  struct parked *expired, *p;
+  struct timespec ts;
+  uint64_t now, deadline;
+
+  pthread_mutex_lock (&c->mutex);
+  while (!c->stop)
+    {
+      expired = NULL;
+      now = now_ns ();
+      while (NULL != (p = c->oldest) && p->stamp + c->ttl <= now)
+        {
+          unlink_parked (c, p);
+          p->chain = expired;
+          expired = p;
+        }
+
+      if (NULL != expired)
+        {
+          pthread_mutex_unlock (&c->mutex);
+          close_all (c, expired);
+          pthread_mutex_lock (&c->mutex);
+          continue;
+        }
+
+      if (NULL == c->oldest)
+        {
+          pthread_cond_wait (&c->cond, &c->mutex);
+          continue;
+        }
+
+      deadline = c->oldest->stamp + c->ttl;
+      ts.tv_sec = deadline / 1000000000ULL;
+      ts.tv_nsec = deadline % 1000000000ULL;
+      pthread_cond_timedwait (&c->cond, &c->mutex, &ts);
+    }
+  pthread_mutex_unlock (&c->mutex);
+  return NULL;
+}
+
+struct handle_cache *
+handle_cache_new (size_t max, double ttl, void (*close) (void *))
+{
+  struct handle_cache *c;
+  pthread_condattr_t attr;
+  size_t nbuckets = 16;
+  int err;
+
+  if (0 == max || ttl <= 0 || NULL == close)
+    {
+      print_error ("Invalid arguments");
+      return NULL;
+    }
+
+  while (nbuckets < max)
+    nbuckets *= 2;
+
+  if (NULL == (c = calloc (1, sizeof *c))
+      || NULL == (c->buckets = calloc (nbuckets, sizeof *c->buckets)))
+    {
+      print_error ("Out of memory");
+      free (c);
+      return NULL;
+    }
+
+  c->close = close;
+  c->max = max;
+  c->ttl = ttl * 1e9;
+  c->nbuckets = nbuckets;
+
+  /* deadlines are on the monotonic clock, like the stamps */
+  pthread_mutex_init (&c->mutex, NULL);
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&c->cond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  if (0 != (err = pthread_create (&c->reaper, NULL, reaper_loop, c)))
+    {
+      print_error ("pthread_create: %s", strerror (err));
+      pthread_cond_destroy (&c->cond);
+      pthread_mutex_destroy (&c->mutex);
+      free (c->buckets);
+      free (c);
+      return NULL;
+    }
+
+  return c;
+}
+
+/* close every parked handle */
+void
+handle_cache_free (struct handle_cache *c)
+{
+  struct parked *all = NULL, *p;
+
+  if (NULL == c)
+    return;
+
+  pthread_mutex_lock (&c->mutex);
+  c->stop = 1;
+  pthread_cond_signal (&c->cond);
+  pthread_mutex_unlock (&c->mutex);
+  pthread_join (c->reaper, NULL);
+
+  while (NULL != (p = c->oldest))
+    {
+      unlink_parked (c, p);
+      p->chain = all;
+      all = p;
+    }
+  close_all (c, all);
+
+  pthread_cond_destroy (&c->cond);
+  pthread_mutex_destroy (&c->mutex);
+  free (c->buckets);
+  free (c);
+}
+
+/* whether any handle on `path' is parked, a hint for callers who would
+ * have to ask the server for the attributes handle_cache_get wants */
+int
+handle_cache_parked (struct handle_cache *c, const char *path)
+{
+  struct parked *p;
+  uint64_t hash;
+  int found = 0;
+
+  if (NULL == c || NULL == path)
+    return 0;
+
+  hash = hash_path (path);
+  pthread_mutex_lock (&c->mutex);
+  for (p = c->buckets[hash & (c->nbuckets - 1)]; NULL != p; p = p->chain)
+    if (p->hash == hash && 0 == strcmp (p->path, path))
+      {
+        found = 1;
+        break;
+      }
+  pthread_mutex_unlock (&c->mutex);
+  return found;
+}
+
+/* a parked handle on `path', taken out of the cache, if the file still has
+ * the size and mtime in `st'. handles on a file that has changed since are
+ * closed. returns NULL if there is none to reuse */
+void *
+handle_cache_get (struct handle_cache *c, const char *path,
+                  const struct stat *st)
+{
+  struct parked *p, *next, *stale = NULL;
+  void *handle = NULL;
+  uint64_t hash;
+
+  if (NULL == c || NULL == path || NULL == st)
+    return NULL;
+
+  hash = hash_path (path);
+  pthread_mutex_lock (&c->mutex);
+  for (p = c->buckets[hash & (c->nbuckets - 1)]; NULL != p; p = next)
+    {
+      next = p->chain;
+      if (p->hash != hash || 0 != strcmp (p->path, path))
+        continue;
+
+      if (p->st.st_size != st->st_size || p->st.st_mtime != st->st_mtime)
+        {
+          unlink_parked (c, p);
+          p->chain = stale;
+          stale = p;
+          continue;
+        }
+
+      /* the newest handle comes first in its bucket */
+      if (NULL == handle)
+        {
+          unlink_parked (c, p);
+          handle = p->handle;
+          free (p);
+        }
+    }
+
+  if (NULL == handle)
+    c->misses++;
+  else
+    c->hits++;
+  pthread_mutex_unlock (&c->mutex);
+
+  close_all (c, stale);
+  return handle;
+}
+
+/* park `handle', open on `path' whose attributes at open time were `st'. the
+ * cache takes it over, if it cannot it is closed right away */
+void
+handle_cache_put (struct handle_cache *c, const char *path, void *handle,
+                  const struct stat *st)
+{
+  struct parked *p, *evicted = NULL;
+  struct parked **b;
+  size_t len;
+
+  if (NULL == c || NULL == path || NULL == handle || NULL == st)
+    return;
+
+  len = strlen (path);
+  if (NULL == (p = malloc (sizeof *p + len + 1)))
+    {
+      print_error ("Out of memory");
+      c->close (handle);
+      return;
+    }
+
+  p->hash = hash_path (path);
+  p->handle = handle;
+  p->st = *st;
+  memcpy (p->path, path, len + 1);
+
+  pthread_mutex_lock (&c->mutex);
+  p->stamp = now_ns ();
+
+  b = &c->buckets[p->hash & (c->nbuckets - 1)];
+  p->chain = *b;
+  *b = p;
+
+  p->newer = NULL;
+  p->older = c->newest;
+  if (NULL == c->newest)
+    c->oldest = p;
+  else
+    c->newest->newer = p;
+  c->newest = p;
+  c->count++;
+
+  while (c->max < c->count)
+    {
+      struct parked *old = c->oldest;
+      unlink_parked (c, old);
+      old->chain = evicted;
+      evicted = old;
+      c->evictions++;
+    }
+
+  /* the reaper sleeps without a deadline on an empty cache */
+  if (1 == c->count)
+    pthread_cond_signal (&c->cond);
+  pthread_mutex_unlock (&c->mutex);
+
+  close_all (c, evicted);
+}
+
+/* hits and misses of handle_cache_get, handles closed to make room and how
+ * many are parked right now */
+void
+handle_cache_stats (struct handle_cache *c, struct lru_stats *st)
+{
+  if (NULL == st)
+    return;
+
+  memset (st, 0, sizeof *st);
+  if (NULL == c)
+    return;
+
+  pthread_mutex_lock (&c->mutex);
+  st->hits = c->hits;
+  st->misses = c->misses;
+  st->evictions = c->evictions;
+  st->entries = c->count;
+  pthread_mutex_unlock (&c->mutex);
+}
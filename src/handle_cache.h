@@ -0,0 +1,30 @@
+#ifndef _H_HANDLE_CACHE
+#define _H_HANDLE_CACHE
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <lru.h>
+
+struct handle_cache;
+
+struct handle_cache *
+handle_cache_new (size_t max, double ttl, void (*close) (void *));
+
+void
+handle_cache_free (struct handle_cache *c);
+
+int
+handle_cache_parked (struct handle_cache *c, const char *path);
+
+void *
+handle_cache_get (struct handle_cache *c, const char *path,
+                  const struct stat *st);
+
+void
+handle_cache_put (struct handle_cache *c, const char *path, void *handle,
+                  const struct stat *st);
+
+void
+handle_cache_stats (struct handle_cache *c, struct lru_stats *st);
+
+#endif
@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <time.h>
+
+#include <inode.h>
+#include <debug.h>
+
+/* the node ids handed to the kernel. every id stands for one path below the
+ * mount point, along with the attributes last seen for it, and lives for as
+ * long as the kernel holds lookups on it: each lookup reply counts one, each
+ * forget takes its count back and the id goes away at zero. ids are never
+ * reused, so one that the kernel still sends after a forget just misses.
+ *
+ * ids and paths are both hashed, a lookup finds an existing id by its path
+ * and every other request finds its path by id. */
+
+struct inode
+{
+  struct inode *ino_chain;
+  struct inode *path_chain;
+  uint64_t ino;
+  uint64_t hash;
+  uint64_t nlookup;
+
+  /* when st was stored, 0 if it never was */
+  uint64_t stamp;
+  struct stat st;
+  char path[];
+};
+
+struct inode_table
+{
+  pthread_mutex_t mutex;
+  struct inode **by_ino;
+  struct inode **by_path;
+  size_t nbuckets;
+  uint64_t count;
+  uint64_t next_ino;
+  struct inode *root;
+};
+
+#define INODE_BUCKETS_MIN 1024
+
+static uint64_t
+hash_path (const char *path)
+{
+  const unsigned char *p = (const unsigned char *) path;
+  uint64_t h = 14695981039346656037ULL;
+
+  for (; '\0' != *p; p++)
+    {
+      h ^= *p;
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+static uint64_t
+hash_ino (uint64_t ino)
+{
+  return ino * 0x9e3779b97f4a7c15ULL;
+}
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the caller must hold t->mutex */
+static struct inode **
+find_ino (struct inode_table *t, uint64_t ino)
+{
+  struct inode **p;
+
+  for (p = &t->by_ino[hash_ino (ino) & (t->nbuckets - 1)]; NULL != *p;
+       p = &(*p)->ino_chain)
+    if ((*p)->ino == ino)
+      break;
+  return p;
+}
+
+/* the caller must hold t->mutex */
+static struct inode **
+find_path (struct inode_table *t, uint64_t hash, const char *path)
+{
+  struct inode **p;
+
+  for (p = &t->by_path[hash & (t->nbuckets - 1)]; NULL != *p;
+       p = &(*p)->path_chain)
+    if ((*p)->hash == hash && 0 == strcmp ((*p)->path, path))
+      break;
+  return p;
+}
+
+/* the caller must hold t->mutex */
+static void
+table_insert (struct inode_table *t, struct inode *n)
+{
+  struct inode **b;
+
+  b = &t->by_ino[hash_ino (n->ino) & (t->nbuckets - 1)];
+  n->ino_chain = *b;
+  *b = n;
+
+  b = &t->by_path[n->hash & (t->nbuckets - 1)];
+  n->path_chain = *b;
+  *b = n;
+
+  t->count++;
+}
+
+/* the caller must hold t->mutex */
+static void
+table_grow (struct inode_table *t)
+{
+  struct inode **by_ino, **by_path;
+  struct inode *n, *next;
+  size_t nbuckets = t->nbuckets * 2;
+  size_t i;
+
+  /* not fatal, the chains just get longer */
+  if (NULL == (by_ino = calloc (nbuckets, sizeof *by_ino))
+      || NULL == (by_path = calloc (nbuckets, sizeof *by_path)))
+    {
+      free (by_ino);
+      return;
+    }
+
+  for (i = 0; i < t->nbuckets; i++)
+    for (n = t->by_ino[i]; NULL != n; n = next)
+      {
+        next = n->ino_chain;
+        n->ino_chain = by_ino[hash_ino (n->ino) & (nbuckets - 1)];
+        by_ino[hash_ino (n->ino) & (nbuckets - 1)] = n;
+        n->path_chain = by_path[n->hash & (nbuckets - 1)];
+        by_path[n->hash & (nbuckets - 1)] = n;
+      }
+
+  free (t->by_ino);
+  free (t->by_path);
+  t->by_ino = by_ino;
+  t->by_path = by_path;
+  t->nbuckets = nbuckets;
+}
+
+static struct inode *
+inode_new (uint64_t ino, const char *path)
+{
+  struct inode *n;
+  size_t len = strlen (path);
+
+  if (NULL == (n = calloc (1, sizeof *n + len + 1)))
+    {
+      print_error ("Out of memory");
+      return NULL;
+    }
+
+  n->ino = ino;
+  n->hash = hash_path (path);
+  memcpy (n->path, path, len + 1);
+  return n;
+}
+
+struct inode_table *
+inode_table_new (void)
+{
+  struct inode_table *t;
+
+  if (NULL == (t = calloc (1, sizeof *t))
+      || NULL == (t->by_ino = calloc (INODE_BUCKETS_MIN, sizeof *t->by_ino))
+      || NULL == (t->by_path = calloc (INODE_BUCKETS_MIN,
+                                       sizeof *t->by_path))
+      || NULL == (t->root = inode_new (INODE_ROOT, "/")))
+    {
+      print_error ("Out of memory");
+      if (NULL != t)
+        {
+          free (t->by_ino);
+          free (t->by_path);
+        }
+      free (t);
+      return NULL;
+    }
+
+  pthread_mutex_init (&t->mutex, NULL);
+  t->nbuckets = INODE_BUCKETS_MIN;
+  t->next_ino = INODE_ROOT + 1;
+
+  /* the root is never looked up, and never forgotten */
+  t->root->nlookup = 1;
+  table_insert (t, t->root);
+  return t;
+}
+
+void
+inode_table_free (struct inode_table *t)
+{
+  struct inode *n, *next;
+  size_t i;
+
+  if (NULL == t)
+    return;
+
+  for (i = 0; i < t->nbuckets; i++)
+    for (n = t->by_ino[i]; NULL != n; n = next)
+      {
+        next = n->ino_chain;
+        free (n);
+      }
+  free (t->by_ino);
+  free (t->by_path);
+  pthread_mutex_destroy (&t->mutex);
+  free (t);
+}
+
+/* the id of `path', made up if it has none yet, with one more lookup
+ * counted against it. `st' becomes its attributes. returns 0 if out of
+ * memory */
+uint64_t
+inode_lookup (struct inode_table *t, const char *path, const struct stat *st)
+{
+  struct inode *n;
+  uint64_t hash = hash_path (path);
+  uint64_t ino = 0;
+
+  pthread_mutex_lock (&t->mutex);
+  if (NULL == (n = *find_path (t, hash, path)))
+    {
+      if (NULL == (n = inode_new (t->next_ino, path)))
+        goto exit;
+      t->next_ino++;
+      if (t->nbuckets < t->count)
+        table_grow (t);
+      table_insert (t, n);
+    }
+
+  n->nlookup++;
+  if (NULL != st)
+    {
+      n->st = *st;
+      n->st.st_ino = n->ino;
+      n->stamp = now_ns ();
+    }
+  ino = n->ino;
+exit:
+  pthread_mutex_unlock (&t->mutex);
+  return ino;
+}
+
+void
+inode_forget (struct inode_table *t, uint64_t ino, uint64_t nlookup)
+{
+  struct inode **p, *n;
+
+  if (INODE_ROOT == ino)
+    return;
+
+  pthread_mutex_lock (&t->mutex);
+  p = find_ino (t, ino);
+  if (NULL == (n = *p))
+    goto exit;
+
+  if (nlookup < n->nlookup)
+    {
+      n->nlookup -= nlookup;
+      goto exit;
+    }
+
+  *p = n->ino_chain;
+  *find_path (t, n->hash, n->path) = n->path_chain;
+  t->count--;
+  free (n);
+exit:
+  pthread_mutex_unlock (&t->mutex);
+}
+
+/* copy the path of `ino' into `buf'. returns -1 if there is no such id or
+ * the path does not fit */
+int
+inode_path (struct inode_table *t, uint64_t ino, char *buf, size_t size)
+{
+  struct inode *n;
+  int err = -1;
+
+  pthread_mutex_lock (&t->mutex);
+  if (NULL != (n = *find_ino (t, ino)) && strlen (n->path) < size)
+    {
+      strcpy (buf, n->path);
+      err = 0;
+    }
+  pthread_mutex_unlock (&t->mutex);
+  return err;
+}
+
+/* the path of `name' inside directory `parent' */
+int
+inode_child_path (struct inode_table *t, uint64_t parent, const char *name,
+                  char *buf, size_t size)
+{
+  struct inode *n;
+  int err = -1;
+
+  pthread_mutex_lock (&t->mutex);
+  if (NULL != (n = *find_ino (t, parent))
+      && snprintf (buf, size, "%s/%s", INODE_ROOT == parent ? "" : n->path,
+                   name) < (int) size)
+    err = 0;
+  pthread_mutex_unlock (&t->mutex);
+  return err;
+}
+
+/* the attributes of `ino', if they are younger than `ttl' seconds */
+int
+inode_getattr (struct inode_table *t, uint64_t ino, double ttl,
+               struct stat *st)
+{
+  struct inode *n;
+  int err = -1;
+
+  pthread_mutex_lock (&t->mutex);
+  if (NULL != (n = *find_ino (t, ino)) && 0 != n->stamp
+      && now_ns () - n->stamp < ttl * 1e9)
+    {
+      *st = n->st;
+      err = 0;
+    }
+  pthread_mutex_unlock (&t->mutex);
+  return err;
+}
+
+void
+inode_setattr (struct inode_table *t, uint64_t ino, const struct stat *st)
+{
+  struct inode *n;
+
+  pthread_mutex_lock (&t->mutex);
+  if (NULL != (n = *find_ino (t, ino)))
+    {
+      n->st = *st;
+      n->st.st_ino = n->ino;
+      n->stamp = now_ns ();
+    }
+  pthread_mutex_unlock (&t->mutex);
+}
+
+/* how many ids the kernel is holding on to */
+uint64_t
+inode_count (struct inode_table *t)
+{
+  uint64_t count;
+
+  pthread_mutex_lock (&t->mutex);
+  count = t->count;
+  pthread_mutex_unlock (&t->mutex);
+  return count;
+}
@@ -0,0 +1,41 @@
+#ifndef _H_INODE
+#define _H_INODE
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* the number of the mount's root, as FUSE numbers it */
+#define INODE_ROOT 1
+
+struct inode_table;
+
+struct inode_table *
+inode_table_new (void);
+
+void
+inode_table_free (struct inode_table *t);
+
+uint64_t
+inode_lookup (struct inode_table *t, const char *path, const struct stat *st);
+
+void
+inode_forget (struct inode_table *t, uint64_t ino, uint64_t nlookup);
+
+int
+inode_path (struct inode_table *t, uint64_t ino, char *buf, size_t size);
+
+int
+inode_child_path (struct inode_table *t, uint64_t parent, const char *name,
+                  char *buf, size_t size);
+
+int
+inode_getattr (struct inode_table *t, uint64_t ino, double ttl,
+               struct stat *st);
+
+void
+inode_setattr (struct inode_table *t, uint64_t ino, const struct stat *st);
+
+uint64_t
+inode_count (struct inode_table *t);
+
+#endif
@@ -0,0 +1,448 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <time.h>
+
+#include <lru.h>
+#include <debug.h>
+
+/* a byte budgeted, sharded LRU map. keys and values are opaque byte strings
+ * that lru_put and lru_get copy in and out. lru_pin instead hands out a
+ * pointer into the entry itself: a pinned entry can still be replaced or
+ * evicted, it just leaves the map without being freed, and the last
+ * lru_unpin frees it. every pin has to be given back before lru_free. each
+ * shard has its own lock, hash table and recency list, which keeps lookups
+ * on different keys from contending. a non-zero ttl makes entries expire
+ * that many seconds after they were stored. */
+
+struct lru_entry
+{
+  struct lru_entry *chain;
+  struct lru_entry *newer;
+  struct lru_entry *older;
+  uint64_t hash;
+  uint64_t expires;
+  size_t klen;
+  size_t len;
+
+  /* readers holding on to the value, see lru_pin. an entry dropped while
+   * pinned is freed by the last lru_unpin */
+  uint32_t pins;
+  uint32_t dropped;
+  char data[];
+};
+
+struct lru_shard
+{
+  pthread_mutex_t mutex;
+  struct lru_entry **buckets;
+  size_t nbuckets;
+  struct lru_entry *newest;
+  struct lru_entry *oldest;
+  size_t bytes;
+  size_t budget;
+  uint64_t entries;
+  /* entries out of the map but still pinned */
+  uint64_t orphans;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+struct lru
+{
+  struct lru_shard *shards;
+  size_t nshards;
+  uint64_t ttl;
+};
+
+#define LRU_BUCKETS_MIN 64
+
+#define charge(e) (sizeof *(e) + (e)->klen + (e)->len)
+
+static uint64_t
+hash_key (const void *key, size_t klen)
+{
+  const unsigned char *p = key;
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < klen; i++)
+    {
+      h ^= p[i];
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct lru *
+lru_new (size_t nshards, size_t budget, double ttl)
+{
+  struct lru *l;
+  size_t i;
+
+  if (0 == nshards)
+    nshards = 1;
+
+  if (NULL == (l = calloc (1, sizeof *l))
+      || NULL == (l->shards = calloc (nshards, sizeof *l->shards)))
+    {
+      print_error ("Out of memory");
+      free (l);
+      return NULL;
+    }
+
+  l->nshards = nshards;
+  l->ttl = 0 < ttl ? ttl * 1e9 : 0;
+  for (i = 0; i < nshards; i++)
+    {
+      struct lru_shard *sh = &l->shards[i];
+      pthread_mutex_init (&sh->mutex, NULL);
+      sh->budget = budget / nshards;
+      sh->nbuckets = LRU_BUCKETS_MIN;
+      if (NULL == (sh->buckets = calloc (sh->nbuckets, sizeof *sh->buckets)))
+        {
+          print_error ("Out of memory");
+          l->nshards = i + 1;
+          lru_free (l);
+          return NULL;
+        }
+    }
+
+  return l;
+}
+
+/* every pin must have been released with lru_unpin by now */
+void
+lru_free (struct lru *l)
+{
+  size_t i;
+
+  if (NULL == l)
+    return;
+
+  for (i = 0; i < l->nshards; i++)
+    {
+      struct lru_shard *sh = &l->shards[i];
+      struct lru_entry *e, *next;
+
+      /* whoever still holds a pin would be left pointing at freed
+       * memory, and the dropped entries it pins are out of reach */
+      if (0 != sh->orphans)
+        print_error ("lru_free: %llu entries still pinned",
+                     (unsigned long long) sh->orphans);
+      for (e = sh->newest; NULL != e; e = next)
+        {
+          next = e->older;
+          free (e);
+        }
+      free (sh->buckets);
+      pthread_mutex_destroy (&sh->mutex);
+    }
+  free (l->shards);
+  free (l);
+}
+
+static struct lru_shard *
+shard_of (struct lru *l, uint64_t hash)
+{
+  /* the low bits pick the bucket, so use the high ones for the shard */
+  return &l->shards[(hash >> 32) % l->nshards];
+}
+
+static struct lru_entry **
+shard_find (struct lru_shard *sh, uint64_t hash, const void *key, size_t klen)
+{
+  struct lru_entry **p;
+
+  for (p = &sh->buckets[hash & (sh->nbuckets - 1)]; NULL != *p;
+       p = &(*p)->chain)
+    if ((*p)->hash == hash && (*p)->klen == klen
+        && 0 == memcmp ((*p)->data, key, klen))
+      break;
+  return p;
+}
+
+static void
+recency_unlink (struct lru_shard *sh, struct lru_entry *e)
+{
+  if (NULL != e->newer)
+    e->newer->older = e->older;
+  else
+    sh->newest = e->older;
+  if (NULL != e->older)
+    e->older->newer = e->newer;
+  else
+    sh->oldest = e->newer;
+  e->newer = e->older = NULL;
+}
+
+static void
+recency_push (struct lru_shard *sh, struct lru_entry *e)
+{
+  e->newer = NULL;
+  e->older = sh->newest;
+  if (NULL != sh->newest)
+    sh->newest->newer = e;
+  sh->newest = e;
+  if (NULL == sh->oldest)
+    sh->oldest = e;
+}
+
+static void
+shard_drop (struct lru_shard *sh, struct lru_entry *e)
+{
+  struct lru_entry **p = shard_find (sh, e->hash, e->data, e->klen);
+
+  *p = e->chain;
+  recency_unlink (sh, e);
+  sh->bytes -= charge (e);
+  sh->entries--;
+  if (0 < e->pins)
+    {
+      e->dropped = 1;
+      sh->orphans++;
+    }
+  else
+    free (e);
+}
+
+static void
+shard_grow (struct lru_shard *sh)
+{
+  struct lru_entry **buckets;
+  struct lru_entry *e;
+  size_t nbuckets = sh->nbuckets * 2;
+
+  /* not fatal, the chains just get longer */
+  if (NULL == (buckets = calloc (nbuckets, sizeof *buckets)))
+    return;
+
+  for (e = sh->newest; NULL != e; e = e->older)
+    {
+      struct lru_entry **b = &buckets[e->hash & (nbuckets - 1)];
+      e->chain = *b;
+      *b = e;
+    }
+
+  free (sh->buckets);
+  sh->buckets = buckets;
+  sh->nbuckets = nbuckets;
+}
+
+ssize_t
+lru_get (struct lru *l, const void *key, size_t klen, void *buf, size_t offset,
+         size_t size)
+{
+  struct lru_shard *sh;
+  struct lru_entry *e;
+  uint64_t hash;
+  ssize_t n = -1;
+
+  if (NULL == l || NULL == key || (NULL == buf && 0 != size))
+    return -1;
+
+  hash = hash_key (key, klen);
+  sh = shard_of (l, hash);
+
+  pthread_mutex_lock (&sh->mutex);
+  if (NULL == (e = *shard_find (sh, hash, key, klen)))
+    {
+      sh->misses++;
+      goto exit;
+    }
+
+  if (e->expires && e->expires <= now_ns ())
+    {
+      shard_drop (sh, e);
+      sh->misses++;
+      goto exit;
+    }
+
+  sh->hits++;
+  recency_unlink (sh, e);
+  recency_push (sh, e);
+
+  n = 0;
+  if (offset < e->len)
+    {
+      n = e->len - offset < size ? e->len - offset : size;
+      memcpy (buf, e->data + e->klen + offset, n);
+    }
+
+exit:
+  pthread_mutex_unlock (&sh->mutex);
+  return n;
+}
+
+int
+lru_put (struct lru *l, const void *key, size_t klen, const void *value,
+         size_t len)
+{
+  struct lru_shard *sh;
+  struct lru_entry *e, *old;
+  struct lru_entry **p;
+
+  if (NULL == l || NULL == key || (NULL == value && 0 != len))
+    return -1;
+
+  if (NULL == (e = malloc (sizeof *e + klen + len)))
+    {
+      print_error ("Out of memory");
+      return -1;
+    }
+
+  e->hash = hash_key (key, klen);
+  e->expires = l->ttl ? now_ns () + l->ttl : 0;
+  e->klen = klen;
+  e->len = len;
+  e->pins = 0;
+  e->dropped = 0;
+  e->newer = e->older = NULL;
+  memcpy (e->data, key, klen);
+  memcpy (e->data + klen, value, len);
+
+  sh = shard_of (l, e->hash);
+  if (sh->budget < charge (e))
+    {
+      free (e);
+      return -1;
+    }
+
+  pthread_mutex_lock (&sh->mutex);
+  if (NULL != (old = *shard_find (sh, e->hash, key, klen)))
+    shard_drop (sh, old);
+
+  while (sh->budget < sh->bytes + charge (e) && NULL != sh->oldest)
+    {
+      shard_drop (sh, sh->oldest);
+      sh->evictions++;
+    }
+
+  if (sh->nbuckets < sh->entries)
+    shard_grow (sh);
+
+  p = &sh->buckets[e->hash & (sh->nbuckets - 1)];
+  e->chain = *p;
+  *p = e;
+  recency_push (sh, e);
+  sh->bytes += charge (e);
+  sh->entries++;
+  pthread_mutex_unlock (&sh->mutex);
+  return 0;
+}
+
+/* like lru_get, but rather than copying the value out point `value' at it.
+ * the value stays put, even if the entry is replaced or evicted meanwhile,
+ * until the returned handle is given back to lru_unpin. NULL on a miss */
+void *
+lru_pin (struct lru *l, const void *key, size_t klen, const void **value,
+         size_t *len)
+{
+  struct lru_shard *sh;
+  struct lru_entry *e;
+  uint64_t hash;
+
+  if (NULL == l || NULL == key || NULL == value || NULL == len)
+    return NULL;
+
+  hash = hash_key (key, klen);
+  sh = shard_of (l, hash);
+
+  pthread_mutex_lock (&sh->mutex);
+  if (NULL == (e = *shard_find (sh, hash, key, klen)))
+    {
+      sh->misses++;
+      goto exit;
+    }
+
+  if (e->expires && e->expires <= now_ns ())
+    {
+      shard_drop (sh, e);
+      sh->misses++;
+      e = NULL;
+      goto exit;
+    }
+
+  sh->hits++;
+  recency_unlink (sh, e);
+  recency_push (sh, e);
+  e->pins++;
+  *value = e->data + e->klen;
+  *len = e->len;
+
+exit:
+  pthread_mutex_unlock (&sh->mutex);
+  return e;
+}
+
+void
+lru_unpin (struct lru *l, void *handle)
+{
+  struct lru_entry *e = handle;
+  struct lru_shard *sh;
+
+  if (NULL == l || NULL == e)
+    return;
+
+  sh = shard_of (l, e->hash);
+  pthread_mutex_lock (&sh->mutex);
+  if (0 == --e->pins && e->dropped)
+    {
+      sh->orphans--;
+      free (e);
+    }
+  pthread_mutex_unlock (&sh->mutex);
+}
+
+void
+lru_remove (struct lru *l, const void *key, size_t klen)
+{
+  struct lru_shard *sh;
+  struct lru_entry *e;
+  uint64_t hash;
+
+  if (NULL == l || NULL == key)
+    return;
+
+  hash = hash_key (key, klen);
+  sh = shard_of (l, hash);
+
+  pthread_mutex_lock (&sh->mutex);
+  if (NULL != (e = *shard_find (sh, hash, key, klen)))
+    shard_drop (sh, e);
+  pthread_mutex_unlock (&sh->mutex);
+}
+
+void
+lru_stats (struct lru *l, struct lru_stats *st)
+{
+  size_t i;
+
+  memset (st, 0, sizeof *st);
+  if (NULL == l)
+    return;
+
+  for (i = 0; i < l->nshards; i++)
+    {
+      struct lru_shard *sh = &l->shards[i];
+      pthread_mutex_lock (&sh->mutex);
+      st->hits += sh->hits;
+      st->misses += sh->misses;
+      st->evictions += sh->evictions;
+      st->entries += sh->entries;
+      st->bytes += sh->bytes;
+      pthread_mutex_unlock (&sh->mutex);
+    }
+}
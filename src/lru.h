@@ -0,0 +1,45 @@
+#ifndef _H_LRU
+#define _H_LRU
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct lru;
+
+struct lru_stats
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t entries;
+  uint64_t bytes;
+};
+
+struct lru *
+lru_new (size_t nshards, size_t budget, double ttl);
+
+void
+lru_free (struct lru *l);
+
+ssize_t
+lru_get (struct lru *l, const void *key, size_t klen, void *buf, size_t offset,
+         size_t size);
+
+int
+lru_put (struct lru *l, const void *key, size_t klen, const void *value,
+         size_t len);
+
+void *
+lru_pin (struct lru *l, const void *key, size_t klen, const void **value,
+         size_t *len);
+
+void
+lru_unpin (struct lru *l, void *handle);
+
+void
+lru_remove (struct lru *l, const void *key, size_t klen);
+
+void
+lru_stats (struct lru *l, struct lru_stats *st);
+
+#endif
@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <pool.h>
+#include <debug.h>
+
+/* recycled objects of one fixed size. every thread keeps a short list of
+ * idle objects of its own, so that taking and giving back the path buffers,
+ * directory entries and handles of a request costs a couple of pointer
+ * moves rather than a trip through malloc. a thread with too many idle
+ * objects passes a batch on to a shared list, which threads that run dry
+ * take batches from; only when that is empty is malloc called. objects
+ * freed by another thread than the one that took them (listings, read
+ * buffers) are fine, they just change hands.
+ *
+ * pools live as long as the process: the idle lists of threads that are
+ * still around may point into them at any time. they are all kept on one
+ * list, for pool_walk. */
+
+#define POOL_CACHE_MAX 64
+#define POOL_BATCH 32
+#define POOL_SHARED_MAX 4096
+
+struct pool_obj
+{
+  struct pool_obj *next;
+};
+
+struct pool_cache
+{
+  struct pool *p;
+  struct pool_obj *head;
+  size_t count;
+};
+
+struct pool
+{
+  const char *name;
+  struct pool *next_pool;
+  size_t size;
+  pthread_key_t key;
+  pthread_mutex_t mutex;
+  struct pool_obj *shared;
+  /* changed under `mutex' but peeked at without it, so every access is
+   * atomic */
+  size_t nshared;
+  /* updated and read atomically */
+  uint64_t allocs;
+  uint64_t reuses;
+};
+
+static struct pool *pools = NULL;
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* hand the idle objects of an exiting thread to the others */
+static void
+cache_release (void *arg)
+{
+  struct pool_cache *c = arg;
+  struct pool *p = c->p;
+  struct pool_obj *o;
+
+  pthread_mutex_lock (&p->mutex);
+  while (NULL != (o = c->head))
+    {
+      c->head = o->next;
+      if (POOL_SHARED_MAX <= __sync_fetch_and_add (&p->nshared, 0))
+        free (o);
+      else
+        {
+          o->next = p->shared;
+          p->shared = o;
+          __sync_fetch_and_add (&p->nshared, 1);
+        }
+    }
+  pthread_mutex_unlock (&p->mutex);
+  free (c);
+}
+
+struct pool *
+pool_new (const char *name, size_t size)
+{
+  struct pool *p;
+  int err;
+
+  if (NULL == (p = calloc (1, sizeof *p)))
+    {
+      print_error ("Out of memory");
+      return NULL;
+    }
+
+  if (0 != (err = pthread_key_create (&p->key, cache_release)))
+    {
+      print_error ("pthread_key_create: %s", strerror (err));
+      free (p);
+      return NULL;
+    }
+
+  p->name = name;
+  p->size = size < sizeof (struct pool_obj) ? sizeof (struct pool_obj) : size;
+  pthread_mutex_init (&p->mutex, NULL);
+
+  pthread_mutex_lock (&pools_mutex);
+  p->next_pool = pools;
+  pools = p;
+  pthread_mutex_unlock (&pools_mutex);
+  return p;
+}
+
+static struct pool_cache *
+cache_of (struct pool *p)
+{
+  struct pool_cache *c;
+
+  if (NULL != (c = pthread_getspecific (p->key)))
+    return c;
+
+  if (NULL == (c = calloc (1, sizeof *c)))
+    return NULL;
+  c->p = p;
+  if (0 != pthread_setspecific (p->key, c))
+    {
+      free (c);
+      return NULL;
+    }
+  return c;
+}
+
+/* an object of the pool's size, its contents are undefined */
+void *
+pool_get (struct pool *p)
+{
+  struct pool_cache *c;
+  struct pool_obj *o;
+  size_t n;
+
+  if (NULL == p)
+    return NULL;
+
+  if (NULL == (c = cache_of (p)))
+    goto fresh;
+
+  /* the count is only peeked at, at worst the lock is taken for nothing or
+   * a batch is left for the next time */
+  if (NULL == c->head && 0 < __sync_fetch_and_add (&p->nshared, 0))
+    {
+      pthread_mutex_lock (&p->mutex);
+      for (n = 0; n < POOL_BATCH && NULL != (o = p->shared); n++)
+        {
+          p->shared = o->next;
+          __sync_fetch_and_sub (&p->nshared, 1);
+          o->next = c->head;
+          c->head = o;
+          c->count++;
+        }
+      pthread_mutex_unlock (&p->mutex);
+    }
+
+  if (NULL != (o = c->head))
+    {
+      c->head = o->next;
+      c->count--;
+      __sync_fetch_and_add (&p->reuses, 1);
+      return o;
+    }
+
+fresh:
+  __sync_fetch_and_add (&p->allocs, 1);
+  if (NULL == (o = malloc (p->size)))
+    print_error ("Out of memory");
+  return o;
+}
+
+void
+pool_put (struct pool *p, void *obj)
+{
+  struct pool_cache *c;
+  struct pool_obj *o = obj;
+  size_t n;
+
+  if (NULL == o)
+    return;
+
+  if (NULL == p || NULL == (c = cache_of (p)))
+    {
+      free (o);
+      return;
+    }
+
+  o->next = c->head;
+  c->head = o;
+  if (++c->count <= POOL_CACHE_MAX)
+    return;
+
+  pthread_mutex_lock (&p->mutex);
+  for (n = 0; n < POOL_BATCH && NULL != (o = c->head); n++)
+    {
+      c->head = o->next;
+      c->count--;
+      if (POOL_SHARED_MAX <= __sync_fetch_and_add (&p->nshared, 0))
+        free (o);
+      else
+        {
+          o->next = p->shared;
+          p->shared = o;
+          __sync_fetch_and_add (&p->nshared, 1);
+        }
+    }
+  pthread_mutex_unlock (&p->mutex);
+}
+
+void
+pool_stats (struct pool *p, uint64_t *allocs, uint64_t *reuses)
+{
+  *allocs = NULL == p ? 0 : __sync_fetch_and_add (&p->allocs, 0);
+  *reuses = NULL == p ? 0 : __sync_fetch_and_add (&p->reuses, 0);
+}
+
+/* call `fn' with the name and stats of every pool there is */
+void
+pool_walk (void (*fn) (void *ctx, const char *name, uint64_t allocs,
+                       uint64_t reuses), void *ctx)
+{
+  struct pool *p;
+
+  pthread_mutex_lock (&pools_mutex);
+  for (p = pools; NULL != p; p = p->next_pool)
+    fn (ctx, p->name, __sync_fetch_and_add (&p->allocs, 0),
+        __sync_fetch_and_add (&p->reuses, 0));
+  pthread_mutex_unlock (&pools_mutex);
+}
@@ -0,0 +1,25 @@
+#ifndef _H_POOL
+#define _H_POOL
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct pool;
+
+struct pool *
+pool_new (const char *name, size_t size);
+
+void *
+pool_get (struct pool *p);
+
+void
+pool_put (struct pool *p, void *obj);
+
+void
+pool_stats (struct pool *p, uint64_t *allocs, uint64_t *reuses);
+
+void
+pool_walk (void (*fn) (void *ctx, const char *name, uint64_t allocs,
+                       uint64_t reuses), void *ctx);
+
+#endif
@@ -17,40 +17,104 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <libssh2.h>
 #include <libssh2_sftp.h>
 #include <list.h>
+#include <lru.h>
+#include <engine.h>
+#include <pool.h>
 #include <debug.h>
 
 #include <sftp.h>
 
-struct sftp
+/* an sftp channel, one of several opened on a session. it is what requests
+ * are made on: path based ones on whichever is least busy, those on a handle
+ * on the one that opened it */
+struct sftp_channel
+{
+  struct sftp_session *ss;
+  LIBSSH2_SFTP *sftp;
+
+  /* its lane on the session's engine channel */
+  size_t lane;
+};
+
+struct sftp_session
 {
+  struct sftp *sftp_ctx;
   int sockfd;
   LIBSSH2_SESSION *session;
-  LIBSSH2_SFTP *sftp;
-  pthread_mutex_t mutex;
+  struct sftp_channel *channels;
+  size_t nchannels;
+  struct engine_chan *chan;
+};
+
+struct sftp
+{
+  struct sftp_session *sessions;
+  size_t nsessions;
+
+  /* those of all sessions, back to back */
+  struct sftp_channel *channels;
+  size_t nchannels;
+  size_t next_channel;
   char jail[PATH_MAX];
   size_t jail_len;
   struct list *list;
   char *mount_point;
   size_t mount_size;
+  struct lru *resolved;
+
+  /* the event loop driving this volume's sessions, see engine.c. NULL if
+   * it could not be started, the sessions then block */
+  struct engine *engine;
+
+  /* updated atomically by whoever made the request, see sftp_stats */
+  struct sftp_stats stats;
 };
 
 struct sftp_dir
 {
   struct sftp *sftp_ctx;
+  struct sftp_channel *channel;
   LIBSSH2_SFTP_HANDLE *handle;
+  pthread_mutex_t mutex;
+  char *path;
+  char *rpath;
+  int eof;
+};
+
+/* sequential read-ahead state of an open file. `buf' holds `len' bytes of the
+ * remote file starting at `start'. while reads stay sequential the window
+ * doubles up to READAHEAD_MAX, a random read drops it back to READAHEAD_MIN */
+struct readahead
+{
+  char *buf;
+  size_t size;
+  off_t start;
+  size_t len;
+  size_t window;
+  off_t next;
+  int eof;
 };
 
+#define READAHEAD_MIN (64 * 1024)
+#define READAHEAD_MAX (4 * 1024 * 1024)
+
 struct sftp_fd
 {
   struct sftp *sftp_ctx;
-  LIBSSH2_SFTP *sftp;
+  struct sftp_channel *channel;
   LIBSSH2_SFTP_HANDLE *handle;
+  /* guards the handle's position, read-ahead and attributes */
+  pthread_mutex_t mutex;
   off_t offset;
+  struct readahead ra;
+  struct stat st;
+  int has_st;
 };
 
 #define pthread_error(expr){ \
@@ -59,108 +123,466 @@ struct sftp_fd
     print_error ("%s", strerror (err)); \
 }
 
-#define sftp_lock(s) pthread_error (pthread_mutex_lock(&s->mutex))
-#define sftp_unlock(s) pthread_error (pthread_mutex_unlock(&s->mutex))
+/* the buffers and structures every request takes and gives back, shared by
+ * all volumes, see pool.c */
+static struct pool *path_pool = NULL;
+static struct pool *fd_pool = NULL;
+static struct pool *dir_pool = NULL;
+static pthread_once_t pools_once = PTHREAD_ONCE_INIT;
 
-static char *
-resolve_path (struct sftp *s, const char *path, char *resolved_path)
+static void
+pools_init (void)
+{
+  path_pool = pool_new ("path", PATH_MAX);
+  fd_pool = pool_new ("fd", sizeof (struct sftp_fd));
+  dir_pool = pool_new ("dir", sizeof (struct sftp_dir));
+}
+
+/* the number of requests queued on `ch' */
+static size_t
+channel_pending (struct sftp_channel *ch)
 {
-  char *jpath = NULL;
-  char *buf = NULL;
-  int jsize = 0;
-  int bsize = 0;
+  return engine_pending (ch->ss->chan, ch->lane);
+}
+
+/* pick a channel for a path based request: the one with the fewest requests
+ * queued, starting from a rotating index so that ties are spread across the
+ * pool. nothing is held, requests queue up on the channel's lane of the
+ * engine */
+static struct sftp_channel *
+channel_acquire (struct sftp *s)
+{
+  struct sftp_channel *ch, *best = NULL;
+  size_t start;
   size_t i;
-  int err;
 
-  if (NULL == s || NULL == path)
-    return NULL;
+  start = __sync_fetch_and_add (&s->next_channel, 1);
+  for (i = 0; i < s->nchannels; i++)
+    {
+      ch = &s->channels[(start + i) % s->nchannels];
+      if (NULL == best || channel_pending (ch) < channel_pending (best))
+        best = ch;
+      if (0 == channel_pending (best))
+        break;
+    }
+  return best;
+}
 
-  jsize = snprintf (NULL, jsize, "%s/%s", s->jail, path);
-  if (jsize < 0)
+/* the libssh2 calls. each one is made from the engine's thread, as often as
+ * it asks to be retried, by call_step. */
+enum call_op
+{
+  CALL_REALPATH,
+  CALL_STAT,
+  CALL_LSTAT,
+  CALL_FSTAT,
+  CALL_OPEN,
+  CALL_OPENDIR,
+  CALL_CLOSE,
+  CALL_SEEK,
+  CALL_READ,
+  CALL_READDIR,
+  CALL_STATVFS
+};
+
+static const char *call_names[SFTP_OPS] =
+{
+  "realpath", "stat", "lstat", "fstat", "open", "opendir", "close", "seek",
+  "read", "readdir", "statvfs"
+};
+
+struct call
+{
+  enum call_op op;
+  struct sftp_channel *ch;
+  LIBSSH2_SFTP_HANDLE *handle;
+  const char *path;
+  char *buf;
+  size_t size;
+  unsigned long flags;
+  long mode;
+  LIBSSH2_SFTP_ATTRIBUTES *attrs;
+  LIBSSH2_SFTP_STATVFS *st;
+
+  /* how much of `buf' a call that fills it piecemeal has filled so far */
+  size_t done;
+  int eof;
+
+  /* the SFTP status of a failed call, read before anybody else gets to use
+   * the channel */
+  unsigned long sftp_err;
+};
+
+static void attrs_to_stat (const LIBSSH2_SFTP_ATTRIBUTES *attrs,
+                           struct stat *buf);
+
+/* fill `buf' with as many directory entries as fit. libssh2 gets a whole
+ * packet of names per request and hands them out one at a time, so this is
+ * mostly copying, with a trip to the network whenever a packet runs out.
+ * progress is kept in `c' for when the step has to be run again */
+static long
+readdir_step (struct call *c)
+{
+  LIBSSH2_SFTP_ATTRIBUTES attrs;
+  struct sftp_dirent *e;
+  long r;
+
+  while (c->size - c->done >= SFTP_DIRENT_MAX)
     {
-      print_error ("snprintf error o0");
-      return NULL;
+      e = (struct sftp_dirent *) (c->buf + c->done);
+      if ((r = libssh2_sftp_readdir (c->handle, e->name, NAME_MAX + 1,
+                                     &attrs)) < 0)
+        {
+          /* an error after some entries is for the next batch to report */
+          if (LIBSSH2_ERROR_EAGAIN == r || 0 == c->done)
+            return r;
+          break;
+        }
+      if (0 == r)
+        {
+          c->eof = 1;
+          break;
+        }
+
+      e->name[r] = '\0';
+      e->reclen = SFTP_DIRENT_SIZE (r);
+      attrs_to_stat (&attrs, &e->st);
+      c->done += e->reclen;
     }
 
-  jsize++;
-  if (NULL == (jpath = malloc (jsize)))
+  return c->done;
+}
+
+static long
+call_step (void *arg)
+{
+  struct call *c = arg;
+  LIBSSH2_SFTP *sftp = c->ch->sftp;
+  long r = 0;
+
+  switch (c->op)
     {
-      print_error ("Out of memory");
-      return NULL;
+      case CALL_REALPATH:
+        r = libssh2_sftp_realpath (sftp, c->path, c->buf, c->size);
+        break;
+      case CALL_STAT:
+        r = libssh2_sftp_stat (sftp, c->path, c->attrs);
+        break;
+      case CALL_LSTAT:
+        r = libssh2_sftp_lstat (sftp, c->path, c->attrs);
+        break;
+      case CALL_FSTAT:
+        r = libssh2_sftp_fstat (c->handle, c->attrs);
+        break;
+      case CALL_OPEN:
+      case CALL_OPENDIR:
+        if (CALL_OPEN == c->op)
+          c->handle = libssh2_sftp_open (sftp, c->path, c->flags, c->mode);
+        else
+          c->handle = libssh2_sftp_opendir (sftp, c->path);
+        if (NULL == c->handle)
+          {
+            r = libssh2_session_last_errno (c->ch->ss->session);
+            if (0 <= r)
+              r = LIBSSH2_ERROR_SFTP_PROTOCOL;
+          }
+        break;
+      case CALL_CLOSE:
+        r = libssh2_sftp_close_handle (c->handle);
+        break;
+      case CALL_SEEK:
+        libssh2_sftp_seek64 (c->handle, c->size);
+        break;
+      case CALL_READ:
+        r = libssh2_sftp_read (c->handle, c->buf, c->size);
+        break;
+      case CALL_READDIR:
+        r = readdir_step (c);
+        break;
+      case CALL_STATVFS:
+        r = libssh2_sftp_statvfs (sftp, c->path, strlen (c->path), c->st);
+        break;
     }
 
-  err = snprintf (jpath, jsize, "%s/%s", s->jail, path);
-  if (jsize - 1 != err)
+  if (LIBSSH2_ERROR_SFTP_PROTOCOL == r)
+    c->sftp_err = libssh2_sftp_last_error (sftp);
+  return r;
+}
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* make `c' on channel `ch', returning what libssh2 returned. its time and
+ * outcome are counted against the channel's volume */
+static long
+channel_call (struct sftp_channel *ch, struct call *c)
+{
+  struct sftp *s = ch->ss->sftp_ctx;
+  struct sftp_op_stats *op = &s->stats.ops[c->op];
+  uint64_t start = now_ns ();
+  uint64_t ns, us;
+  size_t b = 0;
+  long r;
+
+  c->ch = ch;
+  c->sftp_err = 0;
+  r = engine_call (ch->ss->chan, ch->lane, call_step, c);
+
+  ns = now_ns () - start;
+  for (us = ns / 1000; us >>= 1; b++);
+  if (SFTP_LATENCY_BUCKETS <= b)
+    b = SFTP_LATENCY_BUCKETS - 1;
+
+  __sync_fetch_and_add (&op->requests, 1);
+  __sync_fetch_and_add (&op->ns, ns);
+  __sync_fetch_and_add (&op->latency[b], 1);
+  if (r < 0 && LIBSSH2_FX_EOF != c->sftp_err)
+    __sync_fetch_and_add (&op->errors, 1);
+  if (CALL_READ == c->op && 0 < r)
+    __sync_fetch_and_add (&s->stats.read_bytes, r);
+  return r;
+}
+
+/* lock the mutex of a handle, counting the time it takes if another
+ * request has it */
+static void
+handle_lock (struct sftp *s, pthread_mutex_t *mutex)
+{
+  uint64_t start;
+
+  if (0 == pthread_mutex_trylock (mutex))
+    return;
+
+  start = now_ns ();
+  pthread_error (pthread_mutex_lock (mutex));
+  __sync_fetch_and_add (&s->stats.lock_waits, 1);
+  __sync_fetch_and_add (&s->stats.lock_wait_ns, now_ns () - start);
+}
+
+/* paths are canonicalized locally: the jail is prepended, duplicate slashes
+ * and `.' are dropped and `..' is applied without ever leaving the jail. the
+ * server still follows symlinks though, so the directory part of a path (or
+ * the whole path, for operations that follow the last component) has to be
+ * run through a server side realpath once to make sure it does not lead out
+ * of the jail. those answers are kept in `s->resolved' for RESOLVE_TTL
+ * seconds, and an lstat that finds a plain file or directory records it too,
+ * so in the common case no realpath is sent at all. a directory swapped for a
+ * symlink on the server can go unnoticed for up to RESOLVE_TTL. */
+
+#define RESOLVE_TTL 5.0
+#define RESOLVE_BUDGET (4 * 1024 * 1024)
+
+static int
+normalize_path (struct sftp *s, const char *path, char *buf, size_t size,
+                size_t *root)
+{
+  const char *p, *end;
+  size_t prefix;
+  size_t len;
+  size_t n;
+
+  /* the jail without trailing slashes, "/" becomes the empty prefix */
+  for (prefix = s->jail_len; 0 < prefix && '/' == s->jail[prefix - 1];
+       prefix--);
+  if (size <= prefix)
+    return -1;
+  memcpy (buf, s->jail, prefix);
+  len = prefix;
+
+  for (p = path; '\0' != *p; p = end)
     {
-      print_error ("Absurd failure");
-      free (jpath);
-      return NULL;
+      while ('/' == *p)
+        p++;
+      for (end = p; '\0' != *end && '/' != *end; end++);
+      if (0 == (n = end - p) || (1 == n && '.' == p[0]))
+        continue;
+      if (2 == n && '.' == p[0] && '.' == p[1])
+        {
+          /* never above the jail */
+          while (prefix < len && '/' != buf[len - 1])
+            len--;
+          if (prefix < len)
+            len--;
+          continue;
+        }
+      if (size <= len + 1 + n)
+        return -1;
+      buf[len++] = '/';
+      memcpy (buf + len, p, n);
+      len += n;
     }
 
-  bsize = PATH_MAX < jsize ? jsize : PATH_MAX;
-  if (NULL == resolved_path
-      && NULL == (buf = resolved_path = calloc (bsize,
-                                                sizeof *resolved_path)))
+  if (0 == len)
+    buf[len++] = '/';
+  buf[len] = '\0';
+
+  if (NULL != root)
+    *root = prefix;
+  return len;
+}
+
+static int
+in_jail (struct sftp *s, const char *path)
+{
+  size_t prefix;
+
+  for (prefix = s->jail_len; 0 < prefix && '/' == s->jail[prefix - 1];
+       prefix--);
+  if (0 != strncmp (path, s->jail, prefix))
+    return 0;
+  return '\0' == path[prefix] || '/' == path[prefix];
+}
+
+/* the real path of the canonical path `dir', from the cache or the server */
+static int
+resolve_dir (struct sftp *s, struct sftp_channel *ch, const char *dir,
+             char *buf, size_t size)
+{
+  struct call c;
+  ssize_t n;
+  int err;
+
+  if (0 < (n = lru_get (s->resolved, dir, strlen (dir), buf, 0, size - 1)))
     {
-      print_error ("Out of memory");
-      free (jpath);
-      return NULL;
+      buf[n] = '\0';
+      return 0;
     }
 
-  sftp_lock (s);
-  if ((err = libssh2_sftp_realpath (s->sftp,
-                                    jpath,
-                                    resolved_path,
-                                    bsize)) <= 0)
+  memset (&c, 0, sizeof c);
+  c.op = CALL_REALPATH;
+  c.path = dir;
+  c.buf = buf;
+  c.size = size;
+  if ((err = channel_call (ch, &c)) <= 0)
     {
       print_error ("libssh2_sftp_realpath: `%d', trying to resolve `%s'", err,
-                   jpath);
-      free (jpath);
-      jpath = NULL;
+                   dir);
       errno = ENOENT;
-      goto exit;
+      return -1;
     }
+  buf[err < (int) size ? err : (int) size - 1] = '\0';
 
   /* make sure the resolved path is within the jail
    * XXX perhaps the size of a `realpath' packet could be used to determine the
    * existence of a file outside the jail */
-  for (i = 0; i < s->jail_len && s->jail[i] == resolved_path[i]; i++);
-
-  /* if its not in the jail then return NULL */
-  if (i < s->jail_len)
+  if (!in_jail (s, buf))
     {
-      free (jpath);
-      jpath = NULL;
       errno = EACCES;
-      goto exit;
+      return -1;
     }
 
-exit:
-  sftp_unlock (s);
-  free (resolved_path);
-  return jpath;
+  lru_put (s->resolved, dir, strlen (dir), buf, strlen (buf));
+  return 0;
 }
 
-struct sftp *
-sftp_init (struct volume *vol, const char *mount_point)
+/* map `path' to the real path on the server. with `follow' set the last
+ * component is resolved as well, as the server is going to follow it. */
+static char *
+resolve_path (struct sftp *s, struct sftp_channel *ch, const char *path,
+              int follow)
 {
-  struct sftp *s = NULL;
-  LIBSSH2_SESSION *session = NULL;
-  LIBSSH2_SFTP *sftp = NULL;
-  int sockfd = -1;
-  int err;
+  char key[PATH_MAX];
+  char dir[PATH_MAX];
+  char *rpath;
+  const char *rest;
+  size_t root;
+  int len;
 
-  if (NULL == vol)
+  if (NULL == s || NULL == path)
     return NULL;
 
-  if ((err = libssh2_init (0)) < 0)
+  if ((len = normalize_path (s, path, key, sizeof key, &root)) < 0)
     {
-      print_error ("libssh2_init: %d", err);
+      print_error ("Path too long `%s'", path);
+      errno = ENAMETOOLONG;
+      return NULL;
+    }
+
+  /* split off the part the server is going to follow */
+  rest = key + len;
+  if (!follow && root < (size_t) len)
+    {
+      rest = strrchr (key, '/');
+      if (rest < key + root)
+        rest = key + len;
+    }
+
+  if (rest == key)
+    strcpy (dir, "/");
+  else
+    {
+      memcpy (dir, key, rest - key);
+      dir[rest - key] = '\0';
+    }
+
+  if (NULL == (rpath = pool_get (path_pool)))
+    {
+      print_error ("Out of memory");
       return NULL;
     }
 
-  if (vol->name && vol->addr)
-    print_error ("Connecting to `%s' at `%s' ...", vol->name, vol->addr);
+  if (resolve_dir (s, ch, dir, rpath, PATH_MAX) < 0)
+    {
+      pool_put (path_pool, rpath);
+      return NULL;
+    }
+
+  if (strlen (rpath) + strlen (rest) + 1 >= PATH_MAX)
+    {
+      errno = ENAMETOOLONG;
+      pool_put (path_pool, rpath);
+      return NULL;
+    }
+  /* no double slash when the directory resolved to the server's root */
+  if (0 == strcmp (rpath, "/") && '\0' != *rest)
+    *rpath = '\0';
+  strcat (rpath, rest);
+  return rpath;
+}
+
+/* an lstat found `path' to be a plain file or directory at `rpath' */
+static void
+remember_resolved (struct sftp *s, const char *path, const char *rpath)
+{
+  char key[PATH_MAX];
+  int len;
+
+  if (0 <= (len = normalize_path (s, path, key, sizeof key, NULL)))
+    lru_put (s->resolved, key, len, rpath, strlen (rpath));
+}
+
+/* an operation on `path' failed, the cached resolution may be stale */
+static void
+forget_resolved (struct sftp *s, const char *path)
+{
+  char key[PATH_MAX];
+  char *slash;
+  int len;
+
+  if ((len = normalize_path (s, path, key, sizeof key, NULL)) < 0)
+    return;
+  lru_remove (s->resolved, key, len);
+  if (NULL != (slash = strrchr (key, '/')) && slash != key)
+    lru_remove (s->resolved, key, slash - key);
+}
+
+/* open a session to the server of `vol' and the `nchannels' sftp channels
+ * `channels' on it */
+static int
+session_connect (struct sftp_session *ss, struct volume *vol,
+                 struct engine *engine, struct sftp_channel *channels,
+                 size_t nchannels)
+{
+  LIBSSH2_SESSION *session = NULL;
+  LIBSSH2_CHANNEL *lanes[CHANNELS_MAX];
+  size_t i, n = 0;
+  int sockfd = -1;
+  int err;
 
   /* connect to host/port */
   {
@@ -191,6 +613,7 @@ sftp_init (struct volume *vol, const char *mount_point)
 
         if (0 != close (sockfd))
           print_error ("%s", strerror (errno));
+        sockfd = -1;
       }
 
     if (NULL == rp)
@@ -224,25 +647,121 @@ sftp_init (struct volume *vol, const char *mount_point)
       goto error;
     }
 
-  if (NULL == (sftp = libssh2_sftp_init (session)))
+  /* every sftp channel keeps the state of the call it is making, so each
+   * one can have a request in flight while the others have theirs */
+  for (n = 0; n < nchannels; n++)
     {
-      print_error ("libssh2_sftp_init");
+      if (NULL == (channels[n].sftp = libssh2_sftp_init (session)))
+        {
+          print_error ("libssh2_sftp_init: channel %zu of %zu", n + 1,
+                       nchannels);
+          goto error;
+        }
+      channels[n].ss = ss;
+      channels[n].lane = n;
+      lanes[n] = libssh2_sftp_get_channel (channels[n].sftp);
+    }
+
+  /* from here on the engine waits for the socket, not libssh2 */
+  libssh2_session_set_blocking (session, NULL == engine);
+  if (NULL == (ss->chan = engine_attach (engine, sockfd, session, lanes,
+                                         nchannels)))
+    {
+      print_error ("engine_attach");
+      libssh2_session_set_blocking (session, 1);
       goto error;
     }
 
-  libssh2_session_set_blocking (session, 1);
+  ss->sockfd = sockfd;
+  ss->session = session;
+  ss->channels = channels;
+  ss->nchannels = nchannels;
+  return 0;
+
+error:
+  for (i = 0; i < n; i++)
+    if ((err = libssh2_sftp_shutdown (channels[i].sftp)) < 0)
+      print_error ("libssh2_sftp_shutdown: %d", err);
+  if (NULL != session && (err = libssh2_session_free (session)) < 0)
+    print_error ("libssh2_session_free: %d", err);
+  if (0 <= sockfd && 0 != close (sockfd))
+    print_error ("%s", strerror (errno));
+  return -1;
+}
+
+static void
+session_disconnect (struct sftp_session *ss)
+{
+  size_t i;
+  int err;
+
+  /* shutting down is done the blocking way, without the engine */
+  engine_detach (ss->chan);
+  if (NULL != ss->session)
+    libssh2_session_set_blocking (ss->session, 1);
+  for (i = 0; i < ss->nchannels; i++)
+    if ((err = libssh2_sftp_shutdown (ss->channels[i].sftp)) < 0)
+      print_error ("libssh2_sftp_shutdown: %d", err);
+  if (NULL != ss->session && (err = libssh2_session_free (ss->session)) < 0)
+    print_error ("libssh2_session_free: %d", err);
+  if (0 <= ss->sockfd && 0 != close (ss->sockfd))
+    print_error ("%s", strerror (errno));
+}
+
+struct sftp *
+sftp_init (struct volume *vol, const char *mount_point)
+{
+  struct sftp *s = NULL;
+  size_t nsessions;
+  size_t nchannels;
+  size_t i;
+  int err;
+
+  if (NULL == vol)
+    return NULL;
+
+  pthread_once (&pools_once, pools_init);
+
+  if ((err = libssh2_init (0)) < 0)
+    {
+      print_error ("libssh2_init: %d", err);
+      return NULL;
+    }
+
+  nsessions = vol->sessions ? vol->sessions : 1;
+  nchannels = vol->channels ? vol->channels : CHANNELS_DEFAULT;
 
-  if (NULL == (s = malloc (sizeof *s)))
+  print_error ("Connecting to `%s' at `%s' (%zu sessions, %zu channels "
+               "each) ...", vol->name, vol->addr, nsessions, nchannels);
+
+  if (NULL == (s = calloc (1, sizeof *s))
+      || NULL == (s->sessions = calloc (nsessions, sizeof *s->sessions))
+      || NULL == (s->channels = calloc (nsessions * nchannels,
+                                        sizeof *s->channels)))
     {
       print_error ("Out of memory");
       goto error;
     }
 
-  pthread_error (pthread_mutex_init (&s->mutex, NULL));
+  /* every volume has a loop of its own, so the crypto for different
+   * servers runs on different threads */
+  if (NULL == (s->engine = engine_new ()))
+    print_error ("engine_new: sessions of `%s' will block", vol->name);
+
+  for (i = 0; i < nsessions; i++)
+    {
+      if (session_connect (&s->sessions[i], vol, s->engine,
+                           &s->channels[i * nchannels], nchannels) < 0)
+        {
+          print_error ("session_connect: session %zu of %zu", i + 1,
+                       nsessions);
+          goto error;
+        }
+      s->sessions[i].sftp_ctx = s;
+      s->nsessions++;
+      s->nchannels += nchannels;
+    }
 
-  s->sockfd = sockfd;
-  s->session = session;
-  s->sftp = sftp;
   s->mount_point = (char *) mount_point;
   s->mount_size = strlen (mount_point);
 
@@ -253,15 +772,24 @@ sftp_init (struct volume *vol, const char *mount_point)
 
   s->jail_len = strlen (s->jail);
 
+  if (NULL == (s->resolved = lru_new (1, RESOLVE_BUDGET, RESOLVE_TTL)))
+    {
+      print_error ("lru_new");
+      goto error;
+    }
+
   return s;
 
 error:
-  if (NULL != sftp && (err = libssh2_sftp_shutdown (sftp)) < 0)
-    print_error ("libssh2_sftp_shutdown: %d", err);
-  if (NULL != session && (err = libssh2_session_free (session)) < 0)
-    print_error ("libssh2_session_free: %d", err);
-  if (sockfd < 0 && 0 != close (sockfd))
-    print_error ("%s", strerror (errno));
+  if (NULL != s)
+    {
+      for (i = 0; i < s->nsessions; i++)
+        session_disconnect (&s->sessions[i]);
+      engine_free (s->engine);
+      free (s->channels);
+      free (s->sessions);
+      free (s);
+    }
   libssh2_exit ();
   print_error ("sftp_init");
   return NULL;
@@ -270,17 +798,16 @@ error:
 void
 sftp_destroy (struct sftp *s)
 {
-  int err;
+  size_t i;
 
   if (NULL != s)
     {
-      if (NULL != s->sftp && (err = libssh2_sftp_shutdown (s->sftp)) < 0)
-        print_error ("libssh2_sftp_shutdown: %d", err);
-      if (NULL != s->session && (err = libssh2_session_free (s->session)) < 0)
-        print_error ("libssh2_session_free: %d", err);
-      if (s->sockfd < 0 && 0 != close (s->sockfd))
-        print_error ("%s", strerror (errno));
-      pthread_error (pthread_mutex_destroy (&s->mutex));
+      for (i = 0; i < s->nsessions; i++)
+        session_disconnect (&s->sessions[i]);
+      engine_free (s->engine);
+      free (s->channels);
+      free (s->sessions);
+      lru_free (s->resolved);
       libssh2_exit ();
       if (NULL != s->list)
         {
@@ -293,6 +820,47 @@ sftp_destroy (struct sftp *s)
     }
 }
 
+static void
+attrs_to_stat (const LIBSSH2_SFTP_ATTRIBUTES *attrs, struct stat *buf)
+{
+  memset (buf, 0, sizeof *buf);
+  if (attrs->flags & LIBSSH2_SFTP_ATTR_SIZE)
+    {
+      buf->st_size = attrs->filesize;
+      buf->st_blocks = ceil (attrs->filesize / 512.0);
+    }
+  if (attrs->flags & LIBSSH2_SFTP_ATTR_UIDGID)
+    {
+      buf->st_uid = attrs->uid;
+      buf->st_gid = attrs->gid;
+    }
+  if (attrs->flags & LIBSSH2_SFTP_ATTR_PERMISSIONS)
+    buf->st_mode = (LIBSSH2_SFTP_S_ISLNK (attrs->permissions) ? S_IFLNK : 0)
+                 | (LIBSSH2_SFTP_S_ISREG (attrs->permissions) ? S_IFREG : 0)
+                 | (LIBSSH2_SFTP_S_ISDIR (attrs->permissions) ? S_IFDIR : 0)
+                 | (LIBSSH2_SFTP_S_ISCHR (attrs->permissions) ? S_IFCHR : 0)
+                 | (LIBSSH2_SFTP_S_ISBLK (attrs->permissions) ? S_IFBLK : 0)
+                 | (LIBSSH2_SFTP_S_ISFIFO (attrs->permissions) ? S_IFIFO : 0)
+                 | (LIBSSH2_SFTP_S_ISSOCK (attrs->permissions) ? S_IFSOCK : 0)
+                 | (LIBSSH2_SFTP_S_IRUSR & attrs->permissions ? S_IRUSR : 0)
+                 | (LIBSSH2_SFTP_S_IWUSR & attrs->permissions ? S_IWUSR : 0)
+                 | (LIBSSH2_SFTP_S_IXUSR & attrs->permissions ? S_IXUSR : 0)
+                 | (LIBSSH2_SFTP_S_IRGRP & attrs->permissions ? S_IRGRP : 0)
+                 | (LIBSSH2_SFTP_S_IWGRP & attrs->permissions ? S_IWGRP : 0)
+                 | (LIBSSH2_SFTP_S_IXGRP & attrs->permissions ? S_IXGRP : 0)
+                 | (LIBSSH2_SFTP_S_IROTH & attrs->permissions ? S_IROTH : 0)
+                 | (LIBSSH2_SFTP_S_IWOTH & attrs->permissions ? S_IWOTH : 0)
+                 | (LIBSSH2_SFTP_S_IXOTH & attrs->permissions ? S_IXOTH : 0);
+  if (attrs->flags & LIBSSH2_SFTP_ATTR_ACMODTIME)
+    {
+      buf->st_atime = attrs->atime;
+      buf->st_mtime = attrs->mtime;
+      /* ctime is not supported in this version of sftp. 99.9% of applications
+       * should be ok with mtime. */
+      buf->st_ctime = attrs->mtime;
+    }
+}
+
 enum stat_type
 {
   SFTP_STAT,
@@ -304,56 +872,70 @@ static int
 do_sftp_stat (enum stat_type type, void *a0, void *a1, void *a2)
 {
   LIBSSH2_SFTP_ATTRIBUTES attrs;
+  struct sftp_channel *ch = NULL;
   struct sftp *s = NULL;
-  struct sftp_fd *fd;
+  struct sftp_fd *fd = NULL;
   struct stat *buf;
+  struct call c;
   char *path;
   char *rpath = NULL;
   int err;
 
+  memset (&c, 0, sizeof c);
+  c.attrs = &attrs;
+
   /* validate arguments (to a minor extent) */
   switch (type)
     {
       case SFTP_STAT:
       case SFTP_LSTAT:
         s = a0, path = a1, buf = a2;
-        if (NULL == s || NULL == s->sftp || NULL == path || NULL == buf)
+        if (NULL == s || NULL == s->sessions || NULL == path || NULL == buf)
           {
             print_error ("Invalid arguments");
             return -1;
           }
 
-        if (NULL == (rpath = resolve_path (s, path, NULL)))
+        ch = channel_acquire (s);
+        if (NULL == (rpath = resolve_path (s, ch, path, type == SFTP_STAT)))
           {
             print_error ("resolve_path");
-            return -1;
+            err = -1;
+            goto exit;
           }
 
-        sftp_lock (s);
-        if (type == SFTP_STAT)
-          err = libssh2_sftp_stat (s->sftp, rpath, &attrs);
-        else
-          err = libssh2_sftp_lstat (s->sftp, rpath, &attrs);
+        c.op = SFTP_STAT == type ? CALL_STAT : CALL_LSTAT;
+        c.path = rpath;
+        err = channel_call (ch, &c);
 
         if (err < 0)
           {
             print_error ("libssh2_sftp_(l)stat: %d", err);
+            forget_resolved (s, path);
+            /* tell a file that is not there from a server that is not */
+            errno = LIBSSH2_FX_NO_SUCH_FILE == c.sftp_err ? ENOENT : EIO;
             err = -1;
             goto exit;
           }
+
+        /* not a symlink, so this is also where the server would resolve it */
+        if (SFTP_LSTAT == type
+            && (attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS)
+            && !LIBSSH2_SFTP_S_ISLNK (attrs.permissions))
+          remember_resolved (s, path, rpath);
         break;
       case SFTP_FSTAT:
         fd = a0, buf = a1;
-        if (NULL == fd || NULL == fd->handle || NULL == fd->sftp_ctx
+        if (NULL == fd || NULL == fd->handle || NULL == fd->channel
          || NULL == buf)
           {
             print_error ("Invalid arguments");
             return -1;
           }
 
-        s = fd->sftp_ctx;
-        sftp_lock (s);
-        if ((err = libssh2_sftp_fstat (fd->handle, &attrs)) < 0)
+        c.op = CALL_FSTAT;
+        c.handle = fd->handle;
+        if ((err = channel_call (fd->channel, &c)) < 0)
           {
             print_error ("libssh2_sftp_fstat: %d", err);
             err = -1;
@@ -365,47 +947,20 @@ do_sftp_stat (enum stat_type type, void *a0, void *a1, void *a2)
         return -1;
     }
 
-  memset (buf, 0, sizeof *buf);
-  if (attrs.flags & LIBSSH2_SFTP_ATTR_SIZE)
-    {
-      buf->st_size = attrs.filesize;
-      buf->st_blocks = ceil (attrs.filesize / 512.0);
-    }
-  if (attrs.flags & LIBSSH2_SFTP_ATTR_UIDGID)
-    {
-      buf->st_uid = attrs.uid;
-      buf->st_gid = attrs.gid;
-    }
-  if (attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS)
-    buf->st_mode = (LIBSSH2_SFTP_S_ISLNK (attrs.permissions) ? S_IFLNK : 0)
-                 | (LIBSSH2_SFTP_S_ISREG (attrs.permissions) ? S_IFREG : 0)
-                 | (LIBSSH2_SFTP_S_ISDIR (attrs.permissions) ? S_IFDIR : 0)
-                 | (LIBSSH2_SFTP_S_ISCHR (attrs.permissions) ? S_IFCHR : 0)
-                 | (LIBSSH2_SFTP_S_ISBLK (attrs.permissions) ? S_IFBLK : 0)
-                 | (LIBSSH2_SFTP_S_ISFIFO (attrs.permissions) ? S_IFIFO : 0)
-                 | (LIBSSH2_SFTP_S_ISSOCK (attrs.permissions) ? S_IFSOCK : 0)
-                 | (LIBSSH2_SFTP_S_IRUSR & attrs.permissions ? S_IRUSR : 0)
-                 | (LIBSSH2_SFTP_S_IWUSR & attrs.permissions ? S_IWUSR : 0)
-                 | (LIBSSH2_SFTP_S_IXUSR & attrs.permissions ? S_IXUSR : 0)
-                 | (LIBSSH2_SFTP_S_IRGRP & attrs.permissions ? S_IRGRP : 0)
-                 | (LIBSSH2_SFTP_S_IWGRP & attrs.permissions ? S_IWGRP : 0)
-                 | (LIBSSH2_SFTP_S_IXGRP & attrs.permissions ? S_IXGRP : 0)
-                 | (LIBSSH2_SFTP_S_IROTH & attrs.permissions ? S_IROTH : 0)
-                 | (LIBSSH2_SFTP_S_IWOTH & attrs.permissions ? S_IWOTH : 0)
-                 | (LIBSSH2_SFTP_S_IXOTH & attrs.permissions ? S_IXOTH : 0);
-  if (attrs.flags & LIBSSH2_SFTP_ATTR_ACMODTIME)
-    {
-      buf->st_atime = attrs.atime;
-      buf->st_mtime = attrs.mtime;
-      /* ctime is not supported in this version of sftp. 99.9% of applications
-       * should be ok with mtime. */
-      buf->st_ctime = attrs.mtime;
+  attrs_to_stat (&attrs, buf);
+
+  /* remember the attributes of open files, see sftp_fstat_cached */
+  if (SFTP_FSTAT == type)
+    {
+      pthread_mutex_lock (&fd->mutex);
+      fd->st = *buf;
+      fd->has_st = 1;
+      pthread_mutex_unlock (&fd->mutex);
     }
 
   err = 0;
 exit:
-  sftp_unlock (s);
-  free (rpath);
+  pool_put (path_pool, rpath);
   return err;
 }
 
@@ -427,6 +982,28 @@ sftp_lstat (struct sftp *s, const char *path, struct stat *buf)
   return do_sftp_stat (SFTP_LSTAT, s, (char *) path, buf);
 }
 
+/* attributes from the last fstat on this handle, fetching them only if there
+ * has not been one yet */
+int
+sftp_fstat_cached (struct sftp_fd *fd, struct stat *buf)
+{
+  if (NULL == fd || NULL == buf)
+    {
+      print_error ("Invalid arguments");
+      return -1;
+    }
+
+  pthread_mutex_lock (&fd->mutex);
+  if (!fd->has_st)
+    {
+      pthread_mutex_unlock (&fd->mutex);
+      return sftp_fstat (fd, buf);
+    }
+  *buf = fd->st;
+  pthread_mutex_unlock (&fd->mutex);
+  return 0;
+}
+
 static void
 strshift (char *buf, int size, int amount)
 {
@@ -448,10 +1025,11 @@ strshift (char *buf, int size, int amount)
 ssize_t
 sftp_realpath (struct sftp *s, const char *path, char *buf, size_t bufsize)
 {
+  struct sftp_channel *ch;
   char *rpath;
-  int err;
+  ssize_t err;
 
-  if (NULL == s || NULL == s->sftp || NULL == path || NULL == buf
+  if (NULL == s || NULL == s->sessions || NULL == path || NULL == buf
       || 0 == bufsize)
     {
       print_error ("Invalid arguments");
@@ -465,30 +1043,28 @@ sftp_realpath (struct sftp *s, const char *path, char *buf, size_t bufsize)
       return bufsize;
     }
 
-  if (NULL == (rpath = resolve_path (s, path, NULL)))
+  /* resolving the whole path is exactly what the server side realpath does */
+  ch = channel_acquire (s);
+  if (NULL == (rpath = resolve_path (s, ch, path, 1)))
     {
       print_error ("resolve_path");
       return -1;
     }
 
-  sftp_lock (s);
-  if ((err = libssh2_sftp_realpath (s->sftp, rpath, buf, bufsize)) < 0)
-    {
-      print_error ("libssh2_sftp_readlink: %d", err);
-      err = -1;
-    }
-  sftp_unlock (s);
+  err = strlen (rpath);
+  memcpy (buf, rpath, (size_t) err < bufsize ? (size_t) err + 1 : bufsize);
+  buf[bufsize-1] = '\0';
 
   if (0 < err)
     {
       strshift (buf, bufsize, s->mount_size - s->jail_len);
       memcpy (buf, s->mount_point, s->mount_size);
       err = err - s->jail_len + s->mount_size;
-      if (bufsize < err)
+      if ((ssize_t) bufsize < err)
         err = bufsize;
     }
 
-  free (rpath);
+  pool_put (path_pool, rpath);
   return err;
 }
 
@@ -496,10 +1072,12 @@ struct sftp_fd *
 sftp_open (struct sftp *s, const char *path, int flags, mode_t mode)
 {
   struct sftp_fd *fd = NULL;
+  struct sftp_channel *ch;
   unsigned long libssh2_flags = 0;
+  struct call c;
   char *rpath;
 
-  if (NULL == s || NULL == s->sftp || NULL == path)
+  if (NULL == s || NULL == s->sessions || NULL == path)
     {
       print_error ("Invalid arguments");
       return NULL;
@@ -517,15 +1095,18 @@ sftp_open (struct sftp *s, const char *path, int flags, mode_t mode)
     }
 
 
-  if (NULL == (fd = calloc (1, sizeof *fd)))
+  if (NULL == (fd = pool_get (fd_pool)))
     {
       print_error ("Out of memory");
       return NULL;
     }
+  memset (fd, 0, sizeof *fd);
 
-  if (NULL == (rpath = resolve_path (s, path, NULL)))
+  ch = channel_acquire (s);
+  if (NULL == (rpath = resolve_path (s, ch, path, 1)))
     {
       print_error ("resolve_path");
+      pool_put (fd_pool, fd);
       return NULL;
     }
 
@@ -534,28 +1115,35 @@ sftp_open (struct sftp *s, const char *path, int flags, mode_t mode)
                   | (O_RDWR & flags ? LIBSSH2_FXF_READ & LIBSSH2_FXF_WRITE : 0)
                   | (O_APPEND & flags ? LIBSSH2_FXF_APPEND : 0);
 
-  sftp_lock (s);
-  if (NULL == (fd->handle = libssh2_sftp_open (s->sftp, rpath, libssh2_flags,
-                                               mode)))
+  memset (&c, 0, sizeof c);
+  c.op = CALL_OPEN;
+  c.path = rpath;
+  c.flags = libssh2_flags;
+  c.mode = mode;
+  if (channel_call (ch, &c) < 0 || NULL == (fd->handle = c.handle))
     {
-      free (fd);
+      pool_put (fd_pool, fd);
       fd = NULL;
       print_error ("libssh2_sftp_open");
+      forget_resolved (s, path);
       goto exit;
     }
 
+  /* the handle belongs to this sftp channel, so every later request on it
+   * has to go through the same one */
   fd->sftp_ctx = s;
-  fd->sftp = s->sftp;
+  fd->channel = ch;
+  pthread_error (pthread_mutex_init (&fd->mutex, NULL));
 
 exit:
-  sftp_unlock (s);
-  free (rpath);
+  pool_put (path_pool, rpath);
   return fd;
 }
 
 int
 sftp_close (struct sftp_fd * fd)
 {
+  struct call c;
   int err;
 
   if (NULL == fd || NULL == fd->handle)
@@ -564,8 +1152,10 @@ sftp_close (struct sftp_fd * fd)
       return -1;
     }
 
-  sftp_lock (fd->sftp_ctx);
-  if ((err = libssh2_sftp_close (fd->handle)) < 0)
+  memset (&c, 0, sizeof c);
+  c.op = CALL_CLOSE;
+  c.handle = fd->handle;
+  if ((err = channel_call (fd->channel, &c)) < 0)
     {
       print_error ("libssh2_sftp_close: %d", err);
       err = -1;
@@ -574,15 +1164,128 @@ sftp_close (struct sftp_fd * fd)
  
   err = 0;
 exit:
-  sftp_unlock (fd->sftp_ctx);
-  free (fd);
+  pthread_error (pthread_mutex_destroy (&fd->mutex));
+  free (fd->ra.buf);
+  pool_put (fd_pool, fd);
   return err;
 }
 
+/* read `nbyte' bytes at `offset' straight from the server, stopping early only
+ * at end of file, which is then flagged in `eof'. libssh2 keeps a pipeline of
+ * FXP_READ requests outstanding for the remainder of the buffer it is handed,
+ * so asking for a whole window at once costs about one round trip rather than
+ * one per 30k chunk. an error part way through fails the whole read, what came
+ * before it is not passed off as the end of the file. the caller must hold
+ * fd->mutex. */
+static ssize_t
+read_remote (struct sftp_fd *fd, char *buf, size_t nbyte, off_t offset,
+             int *eof)
+{
+  ssize_t amount_read;
+  size_t done = 0;
+  struct call c;
+
+  memset (&c, 0, sizeof c);
+  c.handle = fd->handle;
+
+  /* if the requested offset is not sequential then seek. this drops what
+   * libssh2 had read ahead, so it is run on the engine too */
+  if (offset != fd->offset)
+    {
+      c.op = CALL_SEEK;
+      c.size = offset;
+      channel_call (fd->channel, &c);
+      fd->offset = offset;
+    }
+
+  *eof = 0;
+  c.op = CALL_READ;
+  while (done < nbyte)
+    {
+      c.buf = buf + done;
+      c.size = nbyte - done;
+      if ((amount_read = channel_call (fd->channel, &c)) < 0)
+        {
+          if (LIBSSH2_FX_EOF == c.sftp_err)
+            {
+              *eof = 1;
+              break;
+            }
+          print_error ("libssh2_sftp_read: %ld (%lu)", (long) amount_read,
+                       c.sftp_err);
+          /* where the handle stands after a failed read is anyone's guess,
+           * make the next read seek */
+          fd->offset = -1;
+          return -1;
+        }
+      if (0 == amount_read)
+        {
+          *eof = 1;
+          break;
+        }
+      done += amount_read;
+      fd->offset += amount_read;
+    }
+
+  /* a file known to end here needs no further round trip to say so */
+  if (fd->has_st && fd->st.st_size <= offset + (off_t) done)
+    *eof = 1;
+
+  return done;
+}
+
+/* copy whatever part of [offset, offset + nbyte) the read-ahead buffer holds */
+static size_t
+readahead_copy (struct readahead *ra, char *buf, size_t nbyte, off_t offset)
+{
+  size_t skip;
+  size_t n;
+
+  if (offset < ra->start || (off_t) (ra->start + ra->len) <= offset)
+    return 0;
+
+  skip = offset - ra->start;
+  n = ra->len - skip < nbyte ? ra->len - skip : nbyte;
+  memcpy (buf, ra->buf + skip, n);
+  return n;
+}
+
+/* refill the read-ahead buffer with `want' bytes starting at `offset' */
+static int
+readahead_fill (struct sftp_fd *fd, off_t offset, size_t want)
+{
+  struct readahead *ra = &fd->ra;
+  ssize_t amount_read;
+
+  if (ra->size < want)
+    {
+      char *buf;
+      if (NULL == (buf = realloc (ra->buf, want)))
+        {
+          print_error ("Out of memory");
+          return -1;
+        }
+      ra->buf = buf;
+      ra->size = want;
+    }
+
+  ra->start = offset;
+  ra->len = 0;
+  ra->eof = 0;
+  if ((amount_read = read_remote (fd, ra->buf, want, offset, &ra->eof)) < 0)
+    return -1;
+
+  ra->len = amount_read;
+  return 0;
+}
+
 int
 sftp_read (struct sftp_fd *fd, void *buf, size_t nbyte, off_t offset)
 {
-  int amount_read;
+  struct readahead *ra;
+  size_t done = 0;
+  int sequential;
+  int failed = 0;
 
   if (NULL == fd || NULL == fd->handle || NULL == buf || 0 == nbyte)
     {
@@ -590,24 +1293,84 @@ sftp_read (struct sftp_fd *fd, void *buf, size_t nbyte, off_t offset)
       return -1;
     }
 
-  sftp_lock (fd->sftp_ctx);
-  /* if the requested offset is not sequential then seek */
-  if (offset != fd->offset)
+  handle_lock (fd->sftp_ctx, &fd->mutex);
+  ra = &fd->ra;
+
+  /* grow the window while the caller keeps reading where it left off, fall
+   * back to plain reads of the requested size as soon as it jumps around */
+  sequential = (offset == ra->next);
+  if (!sequential)
+    ra->window = READAHEAD_MIN;
+  else if (ra->window < READAHEAD_MAX)
+    ra->window = ra->window ? ra->window * 2 : READAHEAD_MIN;
+  ra->next = offset + nbyte;
+
+  while (done < nbyte)
     {
-      libssh2_sftp_seek64 (fd->handle, offset);
-      fd->offset = offset;
+      size_t n;
+
+      if (0 < (n = readahead_copy (ra, (char *) buf + done, nbyte - done,
+                                   offset + done)))
+        {
+          done += n;
+          continue;
+        }
+
+      /* nothing past the end of file to fetch */
+      if (ra->eof && (off_t) (ra->start + ra->len) == offset + (off_t) done)
+        break;
+
+      if (!sequential)
+        {
+          ssize_t amount_read;
+          int eof;
+          if ((amount_read = read_remote (fd, (char *) buf + done,
+                                          nbyte - done, offset + done,
+                                          &eof)) < 0)
+            failed = 1;
+          else
+            done += amount_read;
+          break;
+        }
+
+      if (readahead_fill (fd, offset + done, nbyte - done < ra->window
+                                             ? ra->window : nbyte - done) < 0)
+        {
+          failed = 1;
+          break;
+        }
+      if (0 == ra->len)
+        break;
     }
-  if ((amount_read = libssh2_sftp_read (fd->handle, buf, nbyte)) < 0)
+
+  pthread_error (pthread_mutex_unlock (&fd->mutex));
+
+  /* a short count means end of file, anything short of it that went wrong
+   * fails the read rather than handing back a truncated buffer */
+  if (failed)
+    return -1;
+  return done;
+}
+
+/* read [offset, offset + nbyte) straight from the server, past the
+ * read-ahead: neither its buffer nor its idea of where the caller is headed
+ * are touched. for reads issued on the side, such as a hedged copy of a read
+ * that may well lose and be thrown away */
+int
+sftp_pread (struct sftp_fd *fd, void *buf, size_t nbyte, off_t offset)
+{
+  ssize_t amount_read;
+  int eof;
+
+  if (NULL == fd || NULL == fd->handle || NULL == buf || 0 == nbyte)
     {
-      int err;
-      if (LIBSSH2_FX_EOF == (err = libssh2_sftp_last_error (fd->sftp)))
-        errno = EOF;
-      print_error ("libssh2_sftp_read: %d", err);
-      amount_read = -1;
+      print_error ("Invalid arguments");
+      return -1;
     }
-  else
-    fd->offset += amount_read;
-  sftp_unlock (fd->sftp_ctx);
+
+  handle_lock (fd->sftp_ctx, &fd->mutex);
+  amount_read = read_remote (fd, buf, nbyte, offset, &eof);
+  pthread_error (pthread_mutex_unlock (&fd->mutex));
   return amount_read;
 }
 
@@ -615,23 +1378,30 @@ int
 sftp_statvfs (struct sftp *s, const char *path, struct statvfs *buf)
 {
   LIBSSH2_SFTP_STATVFS st;
-  char *rpath;
+  struct sftp_channel *ch;
+  struct call c;
+  char *rpath = NULL;
   int err;
 
-  if (NULL == s || NULL == s->sftp || NULL == path || NULL == buf)
+  if (NULL == s || NULL == s->sessions || NULL == path || NULL == buf)
     {
       print_error ("Invalid arguments");
       return -1;
     }
 
-  if (NULL == (rpath = resolve_path (s, path, NULL)))
+  ch = channel_acquire (s);
+  if (NULL == (rpath = resolve_path (s, ch, path, 1)))
     {
       print_error ("resolve_path");
-      return -1;
+      err = -1;
+      goto exit;
     }
 
-  sftp_lock (s);
-  if ((err = libssh2_sftp_statvfs (s->sftp, rpath, strlen (rpath), &st)) < 0)
+  memset (&c, 0, sizeof c);
+  c.op = CALL_STATVFS;
+  c.path = rpath;
+  c.st = &st;
+  if ((err = channel_call (ch, &c)) < 0)
     {
       print_error ("libssh2_sftp_statvfs: %d", err);
       err = -1;
@@ -652,8 +1422,7 @@ sftp_statvfs (struct sftp *s, const char *path, struct statvfs *buf)
 
   err = 0;
 exit:
-  sftp_unlock (s);
-  free (rpath);
+  pool_put (path_pool, rpath);
   return err;
 }
 
@@ -661,102 +1430,160 @@ struct sftp_dir *
 sftp_opendir (struct sftp *s, const char *path)
 {
   struct sftp_dir *dir = NULL;
+  struct sftp_channel *ch;
   LIBSSH2_SFTP_HANDLE *handle;
-  char *rpath;
+  struct call c;
+  char *rpath = NULL;
 
-  if (NULL == s || NULL == s->sftp || NULL == path)
+  if (NULL == s || NULL == s->sessions || NULL == path)
     {
       print_error ("Invalid arguments");
       return NULL;
     }
 
-  if (NULL == (rpath = resolve_path (s, path, NULL)))
+  ch = channel_acquire (s);
+  if (NULL == (rpath = resolve_path (s, ch, path, 1)))
     {
       print_error ("resolve_path");
-      return NULL;
+      goto exit;
     }
 
-  sftp_lock (s);
-  if (NULL == (handle = libssh2_sftp_opendir (s->sftp, rpath)))
+  memset (&c, 0, sizeof c);
+  c.op = CALL_OPENDIR;
+  c.path = rpath;
+  if (channel_call (ch, &c) < 0 || NULL == (handle = c.handle))
     {
       print_error ("libssh2_sftp_opendir");
+      forget_resolved (s, path);
       goto exit;
     }
 
-  if (NULL == (dir = malloc (sizeof *dir)))
+  if (NULL == (dir = pool_get (dir_pool)))
     {
       int err;
       print_error ("Out of memory");
-      if ((err = libssh2_sftp_closedir (handle)) < 0)
+      c.op = CALL_CLOSE;
+      if ((err = channel_call (ch, &c)) < 0)
         print_error ("libssh2_sftp_closedir: %d", err);
       goto exit;
     }
 
   dir->handle = handle;
   dir->sftp_ctx = s;
+  dir->channel = ch;
+  dir->path = NULL;
+  if (strlen (path) < PATH_MAX && NULL != (dir->path = pool_get (path_pool)))
+    strcpy (dir->path, path);
+  dir->rpath = rpath;
+  dir->eof = 0;
+  rpath = NULL;
+  pthread_error (pthread_mutex_init (&dir->mutex, NULL));
 exit:
-  sftp_unlock (s);
-  free (rpath);
+  pool_put (path_pool, rpath);
   return dir;
 }
 
-struct dirent *
-sftp_readdir (struct sftp_dir *dir)
+/* fill `buf' with the next entries of `dir', as many as fit in `size'
+ * bytes, see struct sftp_dirent. `size' has to be at least
+ * SFTP_DIRENT_MAX. returns the number of bytes filled, 0 at the end of the
+ * directory or -1 */
+ssize_t
+sftp_readdir (struct sftp_dir *dir, void *buf, size_t size)
 {
-  struct dirent *d = NULL;
-  int err;
+  struct sftp_dirent *e;
+  struct call c;
+  long err;
 
-  if (NULL == dir || NULL == dir->sftp_ctx || NULL == dir->handle)
+  if (NULL == dir || NULL == dir->channel || NULL == dir->handle
+      || NULL == buf || size < SFTP_DIRENT_MAX)
     {
       print_error ("Invalid arguments");
-      return NULL;
+      return -1;
     }
 
-  if (NULL == (d = calloc (1, sizeof *d)))
-    {
-      print_error ("Out of memory");
-      return NULL;
-    }
+  memset (&c, 0, sizeof c);
+  c.op = CALL_READDIR;
+  c.handle = dir->handle;
+  c.buf = buf;
+  c.size = size;
 
-  sftp_lock (dir->sftp_ctx);
-  if ((err = libssh2_sftp_readdir (dir->handle, d->d_name, 256, NULL)) < 0)
+  handle_lock (dir->sftp_ctx, &dir->mutex);
+  if (dir->eof)
     {
-      free (d);
-      d = NULL;
+      err = 0;
       goto exit;
     }
-  d->d_reclen = err;
-
-  if (0 == d->d_reclen)
+  if ((err = channel_call (dir->channel, &c)) < 0)
     {
-      free (d);
-      d = NULL;
+      err = -1;
       goto exit;
     }
+  dir->eof = c.eof;
+
+  /* like an lstat, a child that is not a symlink resolves to itself */
+  for (e = buf; (char *) e < (char *) buf + err; e = SFTP_DIRENT_NEXT (e))
+    if (0 != e->st.st_mode && !S_ISLNK (e->st.st_mode)
+        && NULL != dir->path && NULL != dir->rpath
+        && strcmp (e->name, ".") && strcmp (e->name, ".."))
+      {
+        char path[PATH_MAX];
+        char rpath[PATH_MAX];
+        if (snprintf (path, sizeof path, "%s/%s", dir->path, e->name)
+            < (int) sizeof path
+            && snprintf (rpath, sizeof rpath, "%s/%s",
+                         strcmp (dir->rpath, "/") ? dir->rpath : "", e->name)
+               < (int) sizeof rpath)
+          remember_resolved (dir->sftp_ctx, path, rpath);
+      }
 
 exit:
-  sftp_unlock (dir->sftp_ctx);
-  return d;
+  pthread_error (pthread_mutex_unlock (&dir->mutex));
+  return err;
 }
 
 int
 sftp_closedir (struct sftp_dir *dir)
 {
+  struct call c;
   int err;
 
-  if (NULL == dir || NULL == dir->sftp_ctx || NULL == dir->handle)
+  if (NULL == dir || NULL == dir->channel || NULL == dir->handle)
     {
       print_error ("Invalid arguments");
       return -1;
     }
 
-  sftp_lock (dir->sftp_ctx);
-  if ((err = libssh2_sftp_closedir (dir->handle)) < 0)
+  memset (&c, 0, sizeof c);
+  c.op = CALL_CLOSE;
+  c.handle = dir->handle;
+  if ((err = channel_call (dir->channel, &c)) < 0)
     {
       print_error ("libssh2_sftp_closedir: %d", err);
       err = -1;
     }
-  sftp_unlock (dir->sftp_ctx);
-  free (dir);
+  pthread_error (pthread_mutex_destroy (&dir->mutex));
+  pool_put (path_pool, dir->path);
+  pool_put (path_pool, dir->rpath);
+  pool_put (dir_pool, dir);
   return err;
 }
+
+/* a snapshot of the request statistics of `s'. counters are read one at a
+ * time while requests go on, so they need not add up exactly */
+void
+sftp_stats (struct sftp *s, struct sftp_stats *st)
+{
+  size_t i;
+
+  if (NULL == s || NULL == st)
+    return;
+
+  *st = s->stats;
+  for (i = 0; i < SFTP_OPS; i++)
+    st->ops[i].op = call_names[i];
+
+  st->sessions = s->nsessions;
+  st->queued = 0;
+  for (i = 0; i < s->nchannels; i++)
+    st->queued += channel_pending (&s->channels[i]);
+}
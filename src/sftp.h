@@ -2,6 +2,9 @@
 #define _H_LIBSFTP2_H
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <dirent.h>
 
@@ -11,6 +14,57 @@ struct sftp_fd;
 
 #define ADDR_MAX 1024
 #define PORT_MAX 10
+#define SESSIONS_MAX 64
+#define CHANNELS_MAX 16
+#define CHANNELS_DEFAULT 4
+
+/* directory entries are listed in batches, packed back to back into a
+ * buffer of the caller's. `st' holds the attributes the server sent along
+ * with the name, st_mode is 0 if there were none */
+struct sftp_dirent
+{
+  size_t reclen;
+  struct stat st;
+  char name[];
+};
+
+/* the room an entry named `len' bytes long takes up in a batch */
+#define SFTP_DIRENT_SIZE(len) \
+  ((offsetof (struct sftp_dirent, name) + (len) + 1 + 7) & ~(size_t) 7)
+
+/* a batch has room for at least one entry of any name */
+#define SFTP_DIRENT_MAX SFTP_DIRENT_SIZE (NAME_MAX)
+
+#define SFTP_DIRENT_NEXT(e) \
+  ((struct sftp_dirent *) ((char *) (e) + (e)->reclen))
+
+/* what a volume's requests have been doing since it was set up, see
+ * sftp_stats. latencies are counted in power of two buckets of
+ * microseconds, bucket i holding those under 2^(i+1) */
+#define SFTP_OPS 11
+#define SFTP_LATENCY_BUCKETS 32
+
+struct sftp_op_stats
+{
+  const char *op;
+  uint64_t requests;
+  uint64_t errors;
+  uint64_t ns;
+  uint64_t latency[SFTP_LATENCY_BUCKETS];
+};
+
+struct sftp_stats
+{
+  struct sftp_op_stats ops[SFTP_OPS];
+  uint64_t read_bytes;
+
+  /* waits for the lock of a handle another request was using */
+  uint64_t lock_waits;
+  uint64_t lock_wait_ns;
+
+  size_t sessions;
+  size_t queued;
+};
 
 struct volume
 {
@@ -22,6 +76,8 @@ struct volume
   char private_key[PATH_MAX];
   char username[NAME_MAX];
   char passphrase[NAME_MAX];
+  unsigned int sessions;
+  unsigned int channels;
 };
 
 struct sftp *
@@ -39,6 +95,9 @@ sftp_fstat (struct sftp_fd *fd, struct stat *buf);
 int
 sftp_lstat (struct sftp *s, const char *path, struct stat *buf);
 
+int
+sftp_fstat_cached (struct sftp_fd *fd, struct stat *buf);
+
 ssize_t
 sftp_realpath (struct sftp *s, const char *path, char *buf, size_t bufsize);
 
@@ -51,16 +110,22 @@ sftp_close (struct sftp_fd * fd);
 int
 sftp_read (struct sftp_fd *fd, void *buf, size_t nbyte, off_t offset);
 
+int
+sftp_pread (struct sftp_fd *fd, void *buf, size_t nbyte, off_t offset);
+
 int
 sftp_statvfs (struct sftp *s, const char *path, struct statvfs *buf);
 
 struct sftp_dir *
 sftp_opendir (struct sftp *s, const char *path);
 
-struct dirent *
-sftp_readdir (struct sftp_dir *dir);
+ssize_t
+sftp_readdir (struct sftp_dir *dir, void *buf, size_t size);
 
 int
 sftp_closedir (struct sftp_dir *dir);
 
+void
+sftp_stats (struct sftp *s, struct sftp_stats *st);
+
 #endif
@@ -1,14 +1,21 @@
 #include <sftp_tree.h>
 #include <sftp.h>
 #include <list.h>
+#include <lru.h>
+#include <workq.h>
+#include <pool.h>
 #include <debug.h>
 
 #include <libxml/parser.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 enum sftp_type
 {
@@ -17,6 +24,17 @@ enum sftp_type
   SFTP_DST
 };
 
+/* request times in power of two buckets of microseconds. old samples are
+ * halved away every LATENCY_DECAY requests so the picture stays current */
+#define LATENCY_BUCKETS 32
+#define LATENCY_DECAY (16 * 1024)
+
+struct latency
+{
+  uint32_t bucket[LATENCY_BUCKETS];
+  uint32_t count;
+};
+
 struct sftp_node
 {
   enum sftp_type type;
@@ -24,8 +42,97 @@ struct sftp_node
 
   struct list *children;
   size_t last_child;
+
+  /* volume nodes only: the name from the configuration */
+  char *name;
+
+  /* distribute nodes only: path -> index of the child that holds it */
+  struct lru *locations;
+
+  /* mirror nodes only: how each child has been doing lately */
+  struct replica *replicas;
+  pthread_mutex_t mutex;
+
+  /* mirror nodes only: hedging, see hedge_delay */
+  unsigned long hedge_percentile;
+  unsigned long hedge_budget;
+  double hedge_tokens;
+  uint64_t hedges;
+  struct latency meta_latency;
+  struct latency read_latency;
+};
+
+#define LOCATION_BUDGET (4 * 1024 * 1024)
+
+/* mirror children are picked by power of two choices: two random healthy
+ * replicas are compared and the one with the lower expected wait (latency
+ * times requests queued on it) gets the request. a replica that fails
+ * where a sibling succeeds is at fault, after REPLICA_FAULTS_MAX of those
+ * in a row it is left alone for REPLICA_BACKOFF seconds. */
+struct replica
+{
+  /* moving average of the request time in ns, 0 until measured */
+  uint64_t latency;
+  uint32_t inflight;
+  uint32_t faults;
+  uint64_t down_until;
+  uint64_t requests;
+  uint64_t errors;
+};
+
+/* a request on a mirror that has been running for longer than the
+ * hedge_percentile-th percentile of its recent requests gets a duplicate sent
+ * to another replica, the first answer wins. every request earns
+ * hedge_budget / 100 of a hedge, so at most that many percent extra requests
+ * are sent, with bursts of up to HEDGE_TOKENS_MAX */
+#define HEDGE_SAMPLES_MIN 64
+#define HEDGE_TOKENS_MAX 10.0
+#define HEDGE_BUDGET_DEFAULT 5
+#define HEDGE_BUDGET_MAX 100
+#define HEDGE_PERCENTILE_MAX 99
+
+#define REPLICA_FAULTS_MAX 3
+#define REPLICA_BACKOFF 5
+/* weight of a new sample in the moving average, as 1 / 2^n */
+#define REPLICA_EWMA_SHIFT 3
+
+enum traverse_flags
+{
+  /* the first child that succeeds owns the path, remember it */
+  TRAVERSE_LOCATE = 1,
+  /* distribute children may be asked all at once */
+  TRAVERSE_PARALLEL = 2,
+  /* a slow mirror replica may be backed up by another */
+  TRAVERSE_HEDGE = 4
+};
+
+/* how to run one operation down the tree */
+struct tree_op
+{
+  void *(*func) ();
+  size_t nargs;
+  void *error_code;
+  int (*is_error) (void *, void *);
+  /* releases a successful result that lost a parallel lookup */
+  void (*discard) (void *);
+  int flags;
 };
 
+#define WORKQ_THREADS_MIN 4
+#define WORKQ_THREADS_MAX 64
+
+static struct workq *workq = NULL;
+
+/* directory listings have workers of their own, a long one would otherwise
+ * hold on to a worker lookups are waiting for */
+static struct workq *listq = NULL;
+
+#define STATVFS_TTL 5
+#define STATVFS_STALE_MAX 60
+#define STATVFS_BUDGET (64 * 1024)
+
+static struct lru *statvfs_cache = NULL;
+
 struct args
 {
   void *a0;
@@ -33,6 +140,22 @@ struct args
   void *a2;
   void *a3;
   void *a4;
+
+  /* the argument that is an output buffer, if any, so that concurrent
+   * lookups can each be given their own */
+  void **out;
+  size_t out_size;
+
+  /* if set, where the path was found */
+  struct tree_where *where;
+};
+
+/* the topmost mirror on the way to a path and which of its children
+ * answered */
+struct tree_where
+{
+  struct sftp_node *mirror;
+  size_t replica;
 };
 
 #define parse_option(v, k){ \
@@ -44,6 +167,17 @@ struct args
     } \
 }
 
+#define parse_number(v, k, max){ \
+  if (!xmlStrcmp (cur->name, (const xmlChar *) k)) \
+    { \
+      key = xmlNodeListGetString (doc, cur->xmlChildrenNode, 1); \
+      v = strtoul ((const char *) key, NULL, 10); \
+      if (max < v) \
+        v = max; \
+      xmlFree (key); \
+    } \
+}
+
 static struct volume *
 parse_volume (xmlDocPtr doc, xmlNodePtr cur)
 {
@@ -64,11 +198,35 @@ parse_volume (xmlDocPtr doc, xmlNodePtr cur)
       parse_option (v->private_key, "private_key");
       parse_option (v->username, "username");
       parse_option (v->passphrase, "passphrase");
+      parse_number (v->sessions, "sessions", SESSIONS_MAX);
+      parse_number (v->channels, "channels", CHANNELS_MAX);
       cur = cur->next;
     }
   return v;
 }
 
+static void
+parse_mirror (xmlDocPtr doc, xmlNodePtr cur, struct sftp_node *node)
+{
+  xmlChar *key;
+
+  node->hedge_percentile = 0;
+  node->hedge_budget = HEDGE_BUDGET_DEFAULT;
+  node->hedge_tokens = 0;
+  node->hedges = 0;
+  memset (&node->meta_latency, 0, sizeof node->meta_latency);
+  memset (&node->read_latency, 0, sizeof node->read_latency);
+
+  cur = cur->xmlChildrenNode;
+  while (cur != NULL)
+    {
+      parse_number (node->hedge_percentile, "hedge_percentile",
+                    HEDGE_PERCENTILE_MAX);
+      parse_number (node->hedge_budget, "hedge_budget", HEDGE_BUDGET_MAX);
+      cur = cur->next;
+    }
+}
+
 static struct list *
 parse_nodes (xmlDocPtr doc, xmlNodePtr cur, const char *mount_point)
 {
@@ -109,6 +267,13 @@ parse_nodes (xmlDocPtr doc, xmlNodePtr cur, const char *mount_point)
           node->sftp_ctx = s;
           node->children = NULL;
           node->last_child = 0;
+          node->locations = NULL;
+          node->replicas = NULL;
+          if (NULL == (node->name = strdup (v->name)))
+            {
+              print_error ("Out of memory");
+              return NULL;
+            }
           list_add (list, node);
         }
       else if (!xmlStrcmp (cur->name, (const xmlChar *) "mirror"))
@@ -122,12 +287,22 @@ parse_nodes (xmlDocPtr doc, xmlNodePtr cur, const char *mount_point)
           node->type = SFTP_MIR;
           node->sftp_ctx = NULL;
           node->last_child = 0;
+          node->name = NULL;
+          node->locations = NULL;
           node->children = parse_nodes (doc, cur, mount_point);
           if (NULL == node->children)
             {
               print_error ("");
               return NULL;
             }
+          if (NULL == (node->replicas = calloc (list_count (node->children),
+                                                sizeof *node->replicas)))
+            {
+              print_error ("Out of memory");
+              return NULL;
+            }
+          pthread_mutex_init (&node->mutex, NULL);
+          parse_mirror (doc, cur, node);
           list_add (list, node);
         }
       else if (!xmlStrcmp (cur->name, (const xmlChar *) "distribute"))
@@ -141,12 +316,19 @@ parse_nodes (xmlDocPtr doc, xmlNodePtr cur, const char *mount_point)
           node->type = SFTP_DST;
           node->sftp_ctx = NULL;
           node->last_child = 0;
+          node->name = NULL;
+          node->replicas = NULL;
           node->children = parse_nodes (doc, cur, mount_point);
           if (NULL == node->children)
             {
               print_error ("");
               return NULL;
             }
+          if (NULL == (node->locations = lru_new (16, LOCATION_BUDGET, 0)))
+            {
+              print_error ("");
+              return NULL;
+            }
           list_add (list, node);
         }
       else
@@ -167,11 +349,25 @@ parse_nodes (xmlDocPtr doc, xmlNodePtr cur, const char *mount_point)
   return list;
 }
 
+static size_t
+count_volumes (struct sftp_node *root)
+{
+  size_t i, n = 0;
+
+  if (SFTP_VOL == root->type)
+    return 1;
+
+  for (i = 0; i < list_count (root->children); i++)
+    n += count_volumes (list_get (root->children, i));
+  return n;
+}
+
 struct sftp_node *
 sftp_tree_init (const char *path, const char *mount_point)
 {
   struct sftp_node *root;
   struct list *list;
+  size_t nthreads;
   xmlDocPtr doc;
   xmlNodePtr cur;
 
@@ -228,13 +424,34 @@ sftp_tree_init (const char *path, const char *mount_point)
   xmlCleanupParser ();
   list_free (list);
 
+  /* enough threads to ask every volume at once, a few times over. failing
+   * to get them only costs the parallel lookups */
+  nthreads = 2 * count_volumes (root);
+  if (nthreads < WORKQ_THREADS_MIN)
+    nthreads = WORKQ_THREADS_MIN;
+  if (WORKQ_THREADS_MAX < nthreads)
+    nthreads = WORKQ_THREADS_MAX;
+  if (NULL == (workq = workq_new (nthreads)))
+    print_error ("Unable to start worker threads, lookups will be serial");
+
+  /* one listing per volume at a time is plenty */
+  nthreads = count_volumes (root);
+  if (nthreads < WORKQ_THREADS_MIN)
+    nthreads = WORKQ_THREADS_MIN;
+  if (WORKQ_THREADS_MAX < nthreads)
+    nthreads = WORKQ_THREADS_MAX;
+  if (NULL == (listq = workq_new (nthreads)))
+    print_error ("Unable to start listing threads, listings will be serial");
+  if (NULL == (statvfs_cache = lru_new (1, STATVFS_BUDGET, 0)))
+    print_error ("Unable to cache statvfs results");
+
   print_error ("Successful startup!");
 
   return root;
 }
 
-void
-sftp_tree_destroy (struct sftp_node *root)
+static void
+destroy_node (struct sftp_node *root)
 {
   uint64_t i;
 
@@ -248,6 +465,7 @@ sftp_tree_destroy (struct sftp_node *root)
         assert (!root->children);
         assert (!root->last_child);
         sftp_destroy (root->sftp_ctx);
+        free (root->name);
         free (root);
         return;
       case SFTP_MIR:
@@ -255,8 +473,14 @@ sftp_tree_destroy (struct sftp_node *root)
         assert (!root->sftp_ctx);
         assert (root->children);
         for (i = 0; i < list_count (root->children); i++)
-          sftp_tree_destroy (list_get (root->children, i));
+          destroy_node (list_get (root->children, i));
         list_free (root->children);
+        lru_free (root->locations);
+        if (NULL != root->replicas)
+          {
+            pthread_mutex_destroy (&root->mutex);
+            free (root->replicas);
+          }
         free (root);
         return;
     }
@@ -264,180 +488,2528 @@ sftp_tree_destroy (struct sftp_node *root)
   print_error ("Unknown node type");
 }
 
-static void *
-traverse_tree (struct sftp_node *root, void *(*func)(), struct args *a,
-               size_t nargs, void *error_code, int(*is_error)(void *, void *))
+void
+sftp_tree_destroy (struct sftp_node *root)
+{
+  /* jobs still queued may use the tree, let them finish first */
+  workq_free (listq);
+  listq = NULL;
+  workq_free (workq);
+  workq = NULL;
+  destroy_node (root);
+  lru_free (statvfs_cache);
+  statvfs_cache = NULL;
+}
+
+/* the child of distribute node `root' that owns `path'. returns 1 for an
+ * exact hit, 0 if only an ancestor directory's owner is known (a good first
+ * guess, since a subtree that only exists on one child keeps its files
+ * there) and -1 if nothing is known. */
+static int
+location_lookup (struct sftp_node *root, const char *path, uint32_t *child)
+{
+  size_t len = strlen (path);
+  int exact = 1;
+
+  for (;;)
+    {
+      if ((ssize_t) sizeof *child == lru_get (root->locations, path, len,
+                                               child, 0, sizeof *child))
+        return exact;
+
+      /* strip the last component, "/a/b" -> "/a" -> "/" */
+      if (len <= 1)
+        return -1;
+      while (0 < len && '/' != path[len - 1])
+        len--;
+      while (1 < len && '/' == path[len - 1])
+        len--;
+      if (0 == len)
+        return -1;
+      exact = 0;
+    }
+}
+
+static void *traverse_tree (struct sftp_node *root,
+                            const struct tree_op *op, struct args *a,
+                            int *failed);
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the k-th child of mirror `root' other than `skip' that may be asked, where
+ * only healthy ones may be unless there are none */
+static size_t
+replica_nth (struct sftp_node *root, size_t n, size_t skip, uint64_t now,
+             int healthy, size_t k)
 {
-  struct sftp_node *node;
-  void *r;
   size_t i;
 
-  if (NULL == root || NULL == func || NULL == a || NULL == is_error)
+  for (i = 0; i < n; i++)
     {
-      print_error ("Invalid inputs");
-      return error_code;
+      if (i == skip || (healthy && now < root->replicas[i].down_until))
+        continue;
+      if (0 == k--)
+        break;
     }
+  return i;
+}
 
-  switch (root->type)
+/* the best child of mirror `root' to send a request to, never `skip' unless
+ * it is the only one. the caller must hold root->mutex */
+static size_t
+replica_choose (struct sftp_node *root, size_t skip)
+{
+  size_t n = list_count (root->children);
+  uint64_t now = now_ns ();
+  uint64_t cost[2];
+  size_t pick[2];
+  size_t m = 0;
+  size_t i;
+  int healthy = 1;
+
+  for (i = 0; i < n; i++)
+    if (i != skip && root->replicas[i].down_until <= now)
+      m++;
+  if (0 == m)
     {
-      case SFTP_VOL:
-        switch (nargs)
-          {
-            case 1: return func (root->sftp_ctx, a->a0);
-            case 2: return func (root->sftp_ctx, a->a0, a->a1);
-            case 3: return func (root->sftp_ctx, a->a0, a->a1, a->a2);
-          }
-        print_error ("Invalid number of arguments");
-        return error_code;
-      case SFTP_MIR:
-        /* query children in a round-robbin fashion */
-        i = root->last_child++ % list_count (root->children);
-        node = (struct sftp_node *) list_get (root->children, i);
-        if (NULL == node)
-          {
-            print_error ("");
-            return error_code;
-          }
-        return traverse_tree (node, func, a, nargs, error_code, is_error);
-      case SFTP_DST:
-        /* step through children sequentially (depth first search)
-         * FIXME: this should be random! (or more accurate to avoid hammering
-         * the first listed node) */
-        r = error_code;
-        for (i = 0; i < list_count (root->children); i++)
-          {
-            node = (struct sftp_node *) list_get (root->children, i);
-            if (NULL == node)
-              {
-                print_error ("");
-                return error_code;
-              }
+      healthy = 0;
+      m = n - (skip < n);
+    }
 
-            r = traverse_tree (node, func, a, nargs, error_code, is_error);
-            if (!is_error (a, r))
-              return r;
-          }
-        return r;
+  if (0 == m)
+    pick[0] = pick[1] = 0;
+  else
+    {
+      /* a cheap xorshift step is random enough to break ties */
+      size_t x = root->last_child ? root->last_child : now;
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      root->last_child = x;
+
+      pick[0] = replica_nth (root, n, skip, now, healthy, x % m);
+      pick[1] = replica_nth (root, n, skip, now, healthy,
+                             (x % m + 1 + (x >> 16) % (m - (1 < m)))
+                             % m);
     }
 
-  print_error ("Invalid node type");
-  return error_code;
+  for (i = 0; i < 2; i++)
+    {
+      struct replica *rp = &root->replicas[pick[i]];
+      /* an unmeasured replica costs nothing, so everybody gets tried */
+      cost[i] = rp->latency * (rp->inflight + 1);
+    }
+  return cost[1] < cost[0] ? pick[1] : pick[0];
 }
 
-static int
-is_nz_stat (void *v, void *p)
+/* like replica_choose, but the caller must hand the replica back with
+ * replica_done */
+static size_t
+replica_pick (struct sftp_node *root, size_t skip)
 {
-  struct args *a = v;
-  struct stat *buf = a->a1;
-  if (0 != (ssize_t) p)
-    return 1;
-  if (buf->st_size)
-    return 0;
-  return 1;
+  size_t i;
+
+  pthread_mutex_lock (&root->mutex);
+  i = replica_choose (root, skip);
+  root->replicas[i].inflight++;
+  root->replicas[i].requests++;
+  pthread_mutex_unlock (&root->mutex);
+  return i;
 }
 
-int
-sftp_tree_stat (struct sftp_node *root, const char *path, struct stat *buf)
+static void
+latency_add (struct latency *l, uint64_t ns)
 {
-  struct args a = {(char *) path, buf};
-  return (ssize_t) traverse_tree (root, (void *(*)()) sftp_stat, &a, 2,
-                                  (void *) -1, is_nz_stat);
+  uint64_t us = ns / 1000;
+  size_t b = 0;
+
+  while (us >>= 1)
+    b++;
+  if (LATENCY_BUCKETS <= b)
+    b = LATENCY_BUCKETS - 1;
+
+  l->bucket[b]++;
+  if (LATENCY_DECAY <= ++l->count)
+    {
+      l->count = 0;
+      for (b = 0; b < LATENCY_BUCKETS; b++)
+        l->count += l->bucket[b] /= 2;
+    }
 }
 
-int
-sftp_tree_lstat (struct sftp_node *root, const char *path, struct stat *buf)
+/* the upper bound of the bucket holding the `pct'-th percentile, in ns */
+static uint64_t
+latency_percentile (struct latency *l, unsigned long pct)
 {
-  struct args a = {(char *) path, buf};
-  return (ssize_t ) traverse_tree (root, (void *(*)()) sftp_lstat, &a, 2,
-                                   (void *) -1, is_nz_stat);
+  uint64_t want = ((uint64_t) l->count * pct + 99) / 100;
+  uint64_t seen = 0;
+  size_t b;
+
+  for (b = 0; b < LATENCY_BUCKETS - 1; b++)
+    if (want <= (seen += l->bucket[b]))
+      break;
+  return (2ULL << b) * 1000;
 }
 
-static struct statvfs sbuf;
+/* how long to wait before hedging a request on mirror `root', 0 if not at
+ * all. also earns this request's share of the hedge budget */
+static uint64_t
+hedge_delay (struct sftp_node *root, struct latency *l)
+{
+  uint64_t delay = 0;
+
+  if (0 == root->hedge_percentile)
+    return 0;
+
+  pthread_mutex_lock (&root->mutex);
+  root->hedge_tokens += root->hedge_budget / 100.0;
+  if (HEDGE_TOKENS_MAX < root->hedge_tokens)
+    root->hedge_tokens = HEDGE_TOKENS_MAX;
+  if (HEDGE_SAMPLES_MIN <= l->count)
+    delay = latency_percentile (l, root->hedge_percentile);
+  pthread_mutex_unlock (&root->mutex);
+  return delay;
+}
 
+/* whether the budget allows one more hedge on mirror `root' */
 static int
-is_nz_statvfs (void *v, void *p)
+hedge_take (struct sftp_node *root)
 {
-  struct args *a = v;
-  struct statvfs *buf = a->a1;
-  if (0 != (ssize_t) p)
-    return 1;
-  buf->f_blocks = sbuf.f_blocks += buf->f_blocks;
-  buf->f_bfree = sbuf.f_bfree += buf->f_bfree;
-  buf->f_bavail = sbuf.f_bavail += buf->f_bavail;
-  buf->f_files = sbuf.f_files += buf->f_files;
-  buf->f_ffree = sbuf.f_ffree += buf->f_ffree;
-  buf->f_favail = sbuf.f_favail += buf->f_favail;
-  return 1;
+  int ok = 0;
+
+  pthread_mutex_lock (&root->mutex);
+  if (1.0 <= root->hedge_tokens)
+    {
+      root->hedge_tokens -= 1.0;
+      root->hedges++;
+      ok = 1;
+    }
+  pthread_mutex_unlock (&root->mutex);
+  return ok;
 }
 
-int
-sftp_tree_statvfs (struct sftp_node *root, const char *path,
-                   struct statvfs *buf)
+static void
+replica_done (struct sftp_node *root, size_t i, uint64_t elapsed, int failed)
 {
-  struct args a = {(char *) path, buf};
-  sbuf.f_blocks = 0;
-  sbuf.f_bfree = 0;
-  sbuf.f_bavail = 0;
-  sbuf.f_files = 0;
-  sbuf.f_ffree = 0;
-  sbuf.f_favail = 0;
-  return (ssize_t) traverse_tree (root, (void *(*)()) sftp_statvfs, &a, 2,
-                                  (void *) -1, is_nz_statvfs);
+  struct replica *rp = &root->replicas[i];
+
+  pthread_mutex_lock (&root->mutex);
+  rp->inflight--;
+  if (failed)
+    {
+      rp->errors++;
+      /* quick failures say nothing about speed, slow ones do */
+      if (elapsed <= rp->latency)
+        elapsed = 0;
+    }
+  else
+    {
+      rp->faults = 0;
+      latency_add (&root->meta_latency, elapsed);
+    }
+
+  if (0 == rp->latency)
+    rp->latency = elapsed;
+  else if (0 != elapsed)
+    rp->latency += ((int64_t) elapsed - (int64_t) rp->latency)
+                   / (1 << REPLICA_EWMA_SHIFT);
+  pthread_mutex_unlock (&root->mutex);
 }
 
-static int
-is_ltz (void *a, void *p)
+/* child `i' of mirror `root' failed a request that a sibling answered */
+static void
+replica_fault (struct sftp_node *root, size_t i)
 {
-  (void) a;
-  return (ssize_t) p < 0 ? 1 : 0;
+  struct replica *rp = &root->replicas[i];
+
+  pthread_mutex_lock (&root->mutex);
+  if (REPLICA_FAULTS_MAX <= ++rp->faults)
+    {
+      if (rp->down_until <= now_ns ())
+        print_error ("Mirror replica %lu failing, backing off", i);
+      rp->down_until = now_ns () + REPLICA_BACKOFF * 1000000000ULL;
+    }
+  pthread_mutex_unlock (&root->mutex);
 }
 
-ssize_t
-sftp_tree_realpath (struct sftp_node *root, const char *path, char *buf,
-                    size_t bufsize)
+/* run `op' on replica `i' of mirror `root' and account for it. *failed
+ * tells the caller how it went, see traverse_tree */
+static void *
+replica_call (struct sftp_node *root, size_t i, const struct tree_op *op,
+              struct args *a, int *failed)
 {
-  struct args a = {(char *) path, buf, (void *) bufsize};
-  return (ssize_t) traverse_tree (root, (void *(*)()) sftp_realpath, &a, 3,
-                                  (void *) -1, is_ltz);
+  struct sftp_node *node = list_get (root->children, i);
+  uint64_t start;
+  int err;
+  void *r;
+
+  if (NULL == node)
+    {
+      print_error ("");
+      replica_done (root, i, 0, 1);
+      *failed = 1;
+      return op->error_code;
+    }
+
+  /* a missing file is no fault of the replica's */
+  start = now_ns ();
+  r = traverse_tree (node, op, a, failed);
+  err = errno;
+  replica_done (root, i, now_ns () - start, *failed && ENOENT != err);
+  errno = err;
+  return r;
 }
 
-static int
-is_null_open (void *a, void *p)
+/* the state of one parallel lookup across the children of a distribute node.
+ * it is shared by the caller and one task per child and freed by whoever
+ * drops the last reference, since losing tasks may still be running when the
+ * caller has long returned. */
+struct fanout
 {
-  (void) a;
-  struct stat buf;
-  struct sftp_fd *fd = p;
-  if (NULL == fd)
-    return 1;
-  if (sftp_fstat (fd, &buf))
-    return 1;
-  if (buf.st_size)
-    return 0;
-  sftp_close (fd);
-  return 1;
+  pthread_mutex_t mutex;
+  const struct tree_op *op;
+  void *out;
+  size_t out_size;
+  void *result;
+  size_t child;
+  int won;
+  int error;
+  size_t pending;
+  size_t refs;
+  char *path;
+  struct tree_where *where;
+};
+
+struct fanout_task
+{
+  struct fanout *f;
+  struct sftp_node *node;
+  /* set when `node' is a mirror replica that has to be accounted for */
+  struct sftp_node *mirror;
+  size_t child;
+  struct args a;
+  struct tree_where where;
+  char out[];
+};
+
+static void
+fanout_unref (struct fanout *f)
+{
+  int last;
+
+  pthread_mutex_lock (&f->mutex);
+  last = 0 == --f->refs;
+  pthread_mutex_unlock (&f->mutex);
+
+  if (last)
+    {
+      pthread_mutex_destroy (&f->mutex);
+      free (f->path);
+      free (f);
+    }
 }
 
-struct sftp_fd *
-sftp_tree_open (struct sftp_node *root, const char *path, int flags,
-                mode_t mode)
+static void
+fanout_run (void *arg)
 {
-  struct args a = {(char *) path, (void *) (size_t) flags,
-                   (void *) (size_t) mode};
-  return (struct sftp_fd *) traverse_tree (root, (void *(*)()) sftp_open, &a,
-                                           3, NULL, is_null_open);
+  struct fanout_task *t = arg;
+  struct fanout *f = t->f;
+  int discard = 0;
+  int failed;
+  int err;
+  void *r;
+
+  if (NULL != t->mirror)
+    r = replica_call (t->mirror, t->child, f->op, &t->a, &failed);
+  else
+    r = traverse_tree (t->node, f->op, &t->a, &failed);
+
+  err = errno;
+
+  pthread_mutex_lock (&f->mutex);
+  if (failed)
+    {
+      if (!f->won)
+        f->result = r;
+      /* only missing everywhere is missing */
+      if (ENOENT != err || 0 == f->error)
+        f->error = err;
+    }
+  else if (!f->won)
+    {
+      /* the caller is still waiting, so its buffers are still there */
+      f->won = 1;
+      f->result = r;
+      f->child = t->child;
+      if (NULL != f->out)
+        memcpy (f->out, t->out, f->out_size);
+      if (NULL != f->where)
+        *f->where = t->where;
+    }
+  else
+    discard = 1;
+  f->pending--;
+  pthread_mutex_unlock (&f->mutex);
+
+  /* somebody else was faster, release what we got */
+  if (discard && NULL != f->op->discard)
+    f->op->discard (r);
+
+  fanout_unref (f);
+  free (t);
 }
 
 static int
-is_null (void *v, void *p)
+fanout_done (void *arg)
 {
-  (void) v;
-  return p ? 0 : 1;
+  struct fanout *f = arg;
+  int done;
+
+  pthread_mutex_lock (&f->mutex);
+  done = f->won || 0 == f->pending;
+  pthread_mutex_unlock (&f->mutex);
+  return done;
 }
 
-struct sftp_dir *
-sftp_tree_opendir (struct sftp_node *root, const char *path)
+/* send the lookup to every child of `root' except `skip' at once and return
+ * the first success, or an error once all of them failed. */
+static struct fanout *
+fanout_new (const struct tree_op *op, struct args *a)
+{
+  struct fanout *f;
+
+  if (NULL == (f = calloc (1, sizeof *f))
+      || NULL == (f->path = strdup (a->a0)))
+    {
+      print_error ("Out of memory");
+      free (f);
+      return NULL;
+    }
+
+  pthread_mutex_init (&f->mutex, NULL);
+  f->op = op;
+  f->out = NULL == a->out ? NULL : *a->out;
+  f->out_size = a->out_size;
+  f->where = a->where;
+  f->result = op->error_code;
+  f->refs = 1;
+  return f;
+}
+
+/* start the lookup on child `i' of `parent'. for a mirror the replica must
+ * have been handed out by replica_pick, the task hands it back */
+static void
+fanout_add (struct fanout *f, struct sftp_node *parent, size_t i,
+            struct args *a)
+{
+  struct fanout_task *t;
+
+  if (NULL == (t = malloc (sizeof *t + a->out_size)))
+    {
+      print_error ("Out of memory");
+      if (SFTP_MIR == parent->type)
+        replica_done (parent, i, 0, 1);
+      return;
+    }
+
+  /* every task works on its own copy of the arguments and output buffer,
+   * the caller's are only written by the winner */
+  t->f = f;
+  t->node = list_get (parent->children, i);
+  t->mirror = SFTP_MIR == parent->type ? parent : NULL;
+  t->child = i;
+  t->a = *a;
+  t->a.a0 = f->path;
+  if (NULL != a->out)
+    {
+      t->a.out = (void **) ((char *) &t->a + ((char *) a->out
+                                              - (char *) a));
+      *t->a.out = t->out;
+      memcpy (t->out, *a->out, a->out_size);
+    }
+  if (NULL != a->where)
+    {
+      t->where = *a->where;
+      t->a.where = &t->where;
+    }
+
+  pthread_mutex_lock (&f->mutex);
+  f->refs++;
+  f->pending++;
+  pthread_mutex_unlock (&f->mutex);
+
+  if (workq_submit (workq, fanout_run, t, f) < 0)
+    fanout_run (t);
+}
+
+/* wait for the first success, or for every task to fail. `child' is set to
+ * the winner, *failed when there was none */
+static void *
+fanout_finish (struct fanout *f, size_t *child, int *failed)
+{
+  void *r;
+  int won;
+  int err;
+
+  workq_wait (workq, fanout_done, f);
+
+  pthread_mutex_lock (&f->mutex);
+  r = f->result;
+  won = f->won;
+  err = f->error;
+  *child = f->child;
+  pthread_mutex_unlock (&f->mutex);
+
+  *failed = !won;
+  if (!won)
+    {
+      r = f->op->error_code;
+      errno = err ? err : EIO;
+    }
+  fanout_unref (f);
+  return r;
+}
+
+/* send the lookup to every child of `root' except `skip' at once and return
+ * the first success, or an error once all of them failed. */
+static void *
+fanout (struct sftp_node *root, const struct tree_op *op, struct args *a,
+        size_t skip, int *failed)
+{
+  struct fanout *f;
+  size_t n = list_count (root->children);
+  size_t child;
+  size_t i;
+  void *r;
+
+  *failed = 1;
+  if (NULL == (f = fanout_new (op, a)))
+    return op->error_code;
+
+  for (i = 0; i < n; i++)
+    if (i != skip)
+      fanout_add (f, root, i, a);
+
+  r = fanout_finish (f, &child, failed);
+  if (!*failed && (op->flags & TRAVERSE_LOCATE))
+    {
+      uint32_t c = child;
+      lru_put (root->locations, a->a0, strlen (a->a0), &c, sizeof c);
+    }
+  return r;
+}
+
+/* ask the replica `i' of mirror `root' and, if it has not answered after
+ * `delay' ns, one more. *hedged tells whether the second one was sent,
+ * *failed whether neither succeeded */
+static void *
+hedge (struct sftp_node *root, const struct tree_op *op, struct args *a,
+       size_t i, uint64_t delay, size_t *child, int *hedged, int *failed)
 {
-  struct args a = {(char *) path};
-  return (struct sftp_dir *) traverse_tree (root, (void *(*)()) sftp_opendir,
-                                            &a, 1, NULL, is_null);
+  struct fanout *f;
+
+  *hedged = 0;
+  if (NULL == (f = fanout_new (op, a)))
+    {
+      replica_done (root, i, 0, 1);
+      *failed = 1;
+      return op->error_code;
+    }
+
+  fanout_add (f, root, i, a);
+  if (workq_timedwait (workq, fanout_done, f, delay) < 0 && hedge_take (root))
+    {
+      fanout_add (f, root, replica_pick (root, i), a);
+      *hedged = 1;
+    }
+
+  return fanout_finish (f, child, failed);
+}
+
+/* run `op' on the subtree at `root'. whether the result is an error is
+ * judged once, on the volume that produced it, and handed up through
+ * *failed so that the layers above never have to ask op->is_error again */
+static void *
+traverse_tree (struct sftp_node *root, const struct tree_op *op,
+               struct args *a, int *failed)
+{
+  struct sftp_node *node;
+  const char *path = a->a0;
+  uint32_t first = 0;
+  int known = -1;
+  size_t second;
+  uint64_t delay;
+  int err = 0;
+  int top;
+  void *r;
+  size_t i;
+  size_t n;
+
+  *failed = 1;
+  if (NULL == root || NULL == op || NULL == a)
+    {
+      print_error ("Invalid inputs");
+      return NULL == op ? NULL : op->error_code;
+    }
+
+  switch (root->type)
+    {
+      case SFTP_VOL:
+        switch (op->nargs)
+          {
+            case 1: r = op->func (root->sftp_ctx, a->a0); break;
+            case 2: r = op->func (root->sftp_ctx, a->a0, a->a1); break;
+            case 3: r = op->func (root->sftp_ctx, a->a0, a->a1, a->a2); break;
+            default:
+              print_error ("Invalid number of arguments");
+              return op->error_code;
+          }
+        *failed = op->is_error (a, r);
+        return r;
+      case SFTP_MIR:
+        n = list_count (root->children);
+        top = NULL != a->where && NULL == a->where->mirror;
+        if (top)
+          a->where->mirror = root;
+
+        i = replica_pick (root, n);
+        if ((op->flags & TRAVERSE_HEDGE) && 1 < n && NULL != workq
+            && 0 < (delay = hedge_delay (root, &root->meta_latency)))
+          {
+            size_t child = i;
+            int hedged;
+
+            r = hedge (root, op, a, i, delay, &child, &hedged, failed);
+            if (!*failed || hedged)
+              {
+                if (top && !*failed)
+                  a->where->replica = child;
+                return r;
+              }
+          }
+        else
+          r = replica_call (root, i, op, a, failed);
+
+        /* a replica saying there is no such file is an answer, replicas
+         * hold the same data. only another kind of failure, where the
+         * replica itself may be broken, is worth asking a second one */
+        if (!*failed || 1 == n || ENOENT == errno)
+          {
+            if (top)
+              a->where->replica = i;
+            return r;
+          }
+
+        second = replica_pick (root, i);
+        r = replica_call (root, second, op, a, failed);
+        if (!*failed)
+          replica_fault (root, i);
+        if (top)
+          a->where->replica = second;
+        return r;
+      case SFTP_DST:
+        n = list_count (root->children);
+        r = op->error_code;
+
+        /* go straight to the child known to hold the path. if it no longer
+         * does, forget about it and search the others */
+        if (op->flags & TRAVERSE_LOCATE)
+          {
+            known = location_lookup (root, path, &first);
+            if (n <= first)
+              known = -1, first = 0;
+          }
+        if (1 == known)
+          {
+            node = (struct sftp_node *) list_get (root->children, first);
+            r = traverse_tree (node, op, a, failed);
+            if (!*failed)
+              return r;
+            err = errno;
+            lru_remove (root->locations, path, strlen (path));
+          }
+
+        /* ask everybody else at once, the first to find it wins */
+        if (NULL != workq && (op->flags & TRAVERSE_PARALLEL)
+            && 1 < n - (1 == known))
+          {
+            r = fanout (root, op, a, 1 == known ? first : n, failed);
+            if (*failed && 0 != err && ENOENT != err)
+              errno = err;
+            return r;
+          }
+
+        /* step through children sequentially (depth first search) starting
+         * from the best guess */
+        for (i = 0; i < n; i++)
+          {
+            uint32_t child = (first + i) % n;
+            if (1 == known && child == first)
+              continue;
+
+            node = (struct sftp_node *) list_get (root->children, child);
+            if (NULL == node)
+              {
+                print_error ("");
+                *failed = 1;
+                return op->error_code;
+              }
+
+            r = traverse_tree (node, op, a, failed);
+            if (!*failed)
+              {
+                if (op->flags & TRAVERSE_LOCATE)
+                  lru_put (root->locations, path, strlen (path), &child,
+                           sizeof child);
+                return r;
+              }
+            if (ENOENT != errno || 0 == err)
+              err = errno;
+          }
+        *failed = 1;
+        errno = err ? err : EIO;
+        return r;
+    }
+
+  print_error ("Invalid node type");
+  return op->error_code;
+}
+
+/* an empty file is as much there as any other, only a failed call means the
+ * path is not on this child */
+static int
+is_nz_stat (void *a, void *p)
+{
+  (void) a;
+  return 0 != (ssize_t) p;
+}
+
+static const struct tree_op stat_op =
+{
+  (void *(*)()) sftp_stat, 2, (void *) -1, is_nz_stat, NULL,
+  TRAVERSE_LOCATE | TRAVERSE_PARALLEL | TRAVERSE_HEDGE
+};
+
+static const struct tree_op lstat_op =
+{
+  (void *(*)()) sftp_lstat, 2, (void *) -1, is_nz_stat, NULL,
+  TRAVERSE_LOCATE | TRAVERSE_PARALLEL | TRAVERSE_HEDGE
+};
+
+int
+sftp_tree_stat (struct sftp_node *root, const char *path, struct stat *buf)
+{
+  struct args a = {(char *) path, buf};
+  int failed;
+  a.out = &a.a1;
+  a.out_size = sizeof *buf;
+  return (ssize_t) traverse_tree (root, &stat_op, &a, &failed);
+}
+
+int
+sftp_tree_lstat (struct sftp_node *root, const char *path, struct stat *buf)
+{
+  struct args a = {(char *) path, buf};
+  int failed;
+  a.out = &a.a1;
+  a.out_size = sizeof *buf;
+  return (ssize_t ) traverse_tree (root, &lstat_op, &a, &failed);
+}
+
+/* statvfs of the whole tree. every node asks all of its children at once:
+ * a mirror has as much room as its smallest replica, a distribute node the
+ * sum of its children. children that fail are left out rather than failing
+ * the whole call. results are kept per path for STATVFS_TTL seconds, after
+ * that the old answer is still returned while a worker fetches a new one in
+ * the background, so a monitoring poll never waits on a slow volume. only
+ * answers older than STATVFS_STALE_MAX are waited for. */
+struct statvfs_entry
+{
+  struct statvfs st;
+  uint64_t fetched;
+  int refreshing;
+};
+
+struct statvfs_set
+{
+  pthread_mutex_t mutex;
+  size_t pending;
+};
+
+struct statvfs_task
+{
+  struct statvfs_set *set;
+  struct sftp_node *node;
+  const char *path;
+  struct statvfs st;
+  int err;
+};
+
+struct statvfs_refresh
+{
+  struct sftp_node *root;
+  char path[];
+};
+
+static pthread_mutex_t statvfs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int statvfs_node (struct sftp_node *node, const char *path,
+                         struct statvfs *buf);
+
+static void
+statvfs_run (void *arg)
+{
+  struct statvfs_task *t = arg;
+
+  t->err = statvfs_node (t->node, t->path, &t->st);
+
+  pthread_mutex_lock (&t->set->mutex);
+  t->set->pending--;
+  pthread_mutex_unlock (&t->set->mutex);
+}
+
+static int
+statvfs_done (void *arg)
+{
+  struct statvfs_set *set = arg;
+  int done;
+
+  pthread_mutex_lock (&set->mutex);
+  done = 0 == set->pending;
+  pthread_mutex_unlock (&set->mutex);
+  return done;
+}
+
+/* `n' blocks of `from' bytes in blocks of `to' bytes */
+static fsblkcnt_t
+statvfs_scale (fsblkcnt_t n, unsigned long from, unsigned long to)
+{
+  if (from == to || 0 == from || 0 == to)
+    return n;
+  return (long double) n * from / to;
+}
+
+#define statvfs_unit(st) ((st)->f_frsize ? (st)->f_frsize : (st)->f_bsize)
+
+#define statvfs_merge(type, a, b) \
+  ((a) = SFTP_MIR == (type) ? ((b) < (a) ? (b) : (a)) : (a) + (b))
+
+static int
+statvfs_node (struct sftp_node *node, const char *path, struct statvfs *buf)
+{
+  size_t n;
+  size_t i;
+  int found = 0;
+
+  if (SFTP_VOL == node->type)
+    return sftp_statvfs (node->sftp_ctx, path, buf);
+
+  n = list_count (node->children);
+  {
+    struct statvfs_task tasks[n];
+    struct statvfs_set set;
+
+    pthread_mutex_init (&set.mutex, NULL);
+    set.pending = 0;
+    for (i = 0; i < n; i++)
+      {
+        tasks[i].set = &set;
+        tasks[i].node = list_get (node->children, i);
+        tasks[i].path = path;
+        tasks[i].err = -1;
+      }
+
+    /* the first child is done here, the rest on workers */
+    for (i = 1; i < n; i++)
+      {
+        pthread_mutex_lock (&set.mutex);
+        set.pending++;
+        pthread_mutex_unlock (&set.mutex);
+        if (NULL == workq
+            || workq_submit (workq, statvfs_run, &tasks[i], &set) < 0)
+          statvfs_run (&tasks[i]);
+      }
+    tasks[0].err = statvfs_node (tasks[0].node, path, &tasks[0].st);
+    if (NULL != workq)
+      workq_wait (workq, statvfs_done, &set);
+    pthread_mutex_destroy (&set.mutex);
+
+    for (i = 0; i < n; i++)
+      {
+        struct statvfs *st = &tasks[i].st;
+        unsigned long from = statvfs_unit (st);
+        unsigned long to;
+
+        if (tasks[i].err < 0)
+          continue;
+
+        if (!found++)
+          {
+            *buf = *st;
+            continue;
+          }
+
+        /* children may use different block sizes, count in ours */
+        to = statvfs_unit (buf);
+        statvfs_merge (node->type, buf->f_blocks,
+                       statvfs_scale (st->f_blocks, from, to));
+        statvfs_merge (node->type, buf->f_bfree,
+                       statvfs_scale (st->f_bfree, from, to));
+        statvfs_merge (node->type, buf->f_bavail,
+                       statvfs_scale (st->f_bavail, from, to));
+        statvfs_merge (node->type, buf->f_files, st->f_files);
+        statvfs_merge (node->type, buf->f_ffree, st->f_ffree);
+        statvfs_merge (node->type, buf->f_favail, st->f_favail);
+        if (st->f_namemax < buf->f_namemax)
+          buf->f_namemax = st->f_namemax;
+      }
+  }
+
+  return found ? 0 : -1;
+}
+
+static void
+statvfs_refresh_run (void *arg)
+{
+  struct statvfs_refresh *r = arg;
+  struct statvfs_entry e;
+  struct statvfs st;
+  size_t len = strlen (r->path);
+
+  if (0 == statvfs_node (r->root, r->path, &st))
+    {
+      e.st = st;
+      e.fetched = now_ns ();
+      e.refreshing = 0;
+      pthread_mutex_lock (&statvfs_mutex);
+      lru_put (statvfs_cache, r->path, len, &e, sizeof e);
+      pthread_mutex_unlock (&statvfs_mutex);
+    }
+  else
+    {
+      /* keep the old answer, the next call tries again */
+      pthread_mutex_lock (&statvfs_mutex);
+      if ((ssize_t) sizeof e == lru_get (statvfs_cache, r->path, len, &e, 0,
+                                         sizeof e))
+        {
+          e.refreshing = 0;
+          lru_put (statvfs_cache, r->path, len, &e, sizeof e);
+        }
+      pthread_mutex_unlock (&statvfs_mutex);
+    }
+
+  free (r);
+}
+
+int
+sftp_tree_statvfs (struct sftp_node *root, const char *path,
+                   struct statvfs *buf)
+{
+  struct statvfs_entry e;
+  struct statvfs_refresh *r;
+  size_t len;
+  uint64_t age;
+
+  if (NULL == root || NULL == path || NULL == buf)
+    {
+      print_error ("Invalid arguments");
+      return -1;
+    }
+
+  len = strlen (path);
+  pthread_mutex_lock (&statvfs_mutex);
+  if ((ssize_t) sizeof e == lru_get (statvfs_cache, path, len, &e, 0,
+                                     sizeof e)
+      && (age = now_ns () - e.fetched) < STATVFS_STALE_MAX * 1000000000ULL)
+    {
+      if (STATVFS_TTL * 1000000000ULL <= age && !e.refreshing
+          && NULL != workq
+          && NULL != (r = malloc (sizeof *r + len + 1)))
+        {
+          r->root = root;
+          memcpy (r->path, path, len + 1);
+          if (workq_submit (workq, statvfs_refresh_run, r, NULL) < 0)
+            free (r);
+          else
+            {
+              e.refreshing = 1;
+              lru_put (statvfs_cache, path, len, &e, sizeof e);
+            }
+        }
+      pthread_mutex_unlock (&statvfs_mutex);
+      *buf = e.st;
+      return 0;
+    }
+  pthread_mutex_unlock (&statvfs_mutex);
+
+  if (statvfs_node (root, path, buf) < 0)
+    return -1;
+
+  e.st = *buf;
+  e.fetched = now_ns ();
+  e.refreshing = 0;
+  pthread_mutex_lock (&statvfs_mutex);
+  lru_put (statvfs_cache, path, len, &e, sizeof e);
+  pthread_mutex_unlock (&statvfs_mutex);
+  return 0;
+}
+
+static int
+is_ltz (void *a, void *p)
+{
+  (void) a;
+  return (ssize_t) p < 0 ? 1 : 0;
+}
+
+static const struct tree_op realpath_op =
+{
+  (void *(*)()) sftp_realpath, 3, (void *) -1, is_ltz, NULL,
+  TRAVERSE_LOCATE | TRAVERSE_PARALLEL | TRAVERSE_HEDGE
+};
+
+ssize_t
+sftp_tree_realpath (struct sftp_node *root, const char *path, char *buf,
+                    size_t bufsize)
+{
+  struct args a = {(char *) path, buf, (void *) bufsize};
+  int failed;
+  a.out = &a.a1;
+  a.out_size = bufsize;
+  return (ssize_t) traverse_tree (root, &realpath_op, &a, &failed);
+}
+
+static int
+is_null_open (void *a, void *p)
+{
+  (void) a;
+  return NULL == p;
+}
+
+static void
+discard_open (void *p)
+{
+  sftp_close (p);
+}
+
+static const struct tree_op open_op =
+{
+  (void *(*)()) sftp_open, 3, NULL, is_null_open, discard_open,
+  TRAVERSE_LOCATE | TRAVERSE_PARALLEL | TRAVERSE_HEDGE
+};
+
+/* a file opened through the tree. files below a mirror can be read from
+ * all of its replicas at once: large sequential reads are split into one
+ * range per replica, fetched in parallel and reassembled in a read-ahead
+ * buffer, so a stream gets the bandwidth of every copy. */
+struct sftp_tree_fd
+{
+  pthread_mutex_t mutex;
+  struct sftp_fd *fd;
+  struct stat st;
+  int flags;
+  char *path;
+
+  /* the topmost mirror above the file and a handle on each of its children,
+   * opened on first use. `fd' is one of them */
+  struct tree_where where;
+  struct sftp_fd **replicas;
+  char *unusable;
+
+  /* hedged reads still running on the handles */
+  size_t hedging;
+
+  /* the whole file, if sftp_tree_prefetch got it. reads are served from
+   * here alone, the file is as it was when it was opened */
+  char *data;
+  size_t data_len;
+
+  /* striped read-ahead, same scheme as the one in sftp_read */
+  char *buf;
+  size_t size;
+  off_t start;
+  size_t len;
+  size_t window;
+  off_t next;
+  int eof;
+};
+
+#define STRIPE_MIN (256 * 1024)
+#define STRIPE_WINDOW_MIN (1024 * 1024)
+#define STRIPE_WINDOW_MAX (8 * 1024 * 1024)
+
+struct stripe
+{
+  struct stripe_set *set;
+  struct sftp_fd *fd;
+  char *buf;
+  size_t size;
+  off_t offset;
+  ssize_t got;
+};
+
+struct stripe_set
+{
+  pthread_mutex_t mutex;
+  size_t pending;
+};
+
+/* a read that may be sent to two replicas. the first to deliver copies its
+ * data to the caller, who waits for that, the other one just cleans up */
+struct hedged_read
+{
+  pthread_mutex_t mutex;
+  char *out;
+  ssize_t got;
+  int won;
+  size_t pending;
+  size_t refs;
+};
+
+struct hedged_read_task
+{
+  struct hedged_read *h;
+  struct sftp_tree_fd *tfd;
+  struct sftp_fd *fd;
+  /* the backup read, which leaves its handle's read-ahead alone */
+  int backup;
+  size_t size;
+  off_t offset;
+  char buf[];
+};
+
+struct sftp_tree_fd *
+sftp_tree_open (struct sftp_node *root, const char *path, int flags,
+                mode_t mode)
+{
+  struct args a = {(char *) path, (void *) (size_t) flags,
+                   (void *) (size_t) mode};
+  struct sftp_tree_fd *tfd;
+  int failed;
+  size_t n;
+
+  if (NULL == (tfd = calloc (1, sizeof *tfd))
+      || NULL == (tfd->path = strdup (path)))
+    {
+      print_error ("Out of memory");
+      free (tfd);
+      return NULL;
+    }
+
+  a.where = &tfd->where;
+  if (NULL == (tfd->fd = traverse_tree (root, &open_op, &a, &failed)))
+    goto error;
+
+  if (sftp_fstat_cached (tfd->fd, &tfd->st) < 0)
+    {
+      print_error ("sftp_fstat");
+      goto error;
+    }
+
+  tfd->flags = flags;
+  pthread_mutex_init (&tfd->mutex, NULL);
+
+  /* only worth it with somebody to do the work and more than one copy */
+  if (NULL != tfd->where.mirror && NULL != workq
+      && 1 < (n = list_count (tfd->where.mirror->children)))
+    {
+      tfd->replicas = calloc (n, sizeof *tfd->replicas);
+      tfd->unusable = calloc (n, 1);
+      if (NULL == tfd->replicas || NULL == tfd->unusable)
+        {
+          free (tfd->replicas);
+          free (tfd->unusable);
+          tfd->replicas = NULL;
+          tfd->unusable = NULL;
+          tfd->where.mirror = NULL;
+        }
+      else
+        tfd->replicas[tfd->where.replica] = tfd->fd;
+    }
+  else
+    tfd->where.mirror = NULL;
+
+  return tfd;
+
+error:
+  if (NULL != tfd->fd)
+    sftp_close (tfd->fd);
+  free (tfd->path);
+  free (tfd);
+  return NULL;
+}
+
+int
+sftp_tree_fstat (struct sftp_tree_fd *tfd, struct stat *buf)
+{
+  if (NULL == tfd || NULL == buf)
+    {
+      print_error ("Invalid arguments");
+      return -1;
+    }
+
+  *buf = tfd->st;
+  return 0;
+}
+
+static int
+hedges_done (void *arg)
+{
+  struct sftp_tree_fd *tfd = arg;
+  return 0 == __sync_fetch_and_add (&tfd->hedging, 0);
+}
+
+int
+sftp_tree_close (struct sftp_tree_fd *tfd)
+{
+  int err = 0;
+  size_t i;
+
+  if (NULL == tfd)
+    return -1;
+
+  /* a losing hedged read may still be using our handles */
+  if (NULL != workq)
+    workq_wait (workq, hedges_done, tfd);
+
+  if (NULL != tfd->replicas)
+    for (i = 0; i < list_count (tfd->where.mirror->children); i++)
+      if (NULL != tfd->replicas[i] && tfd->replicas[i] != tfd->fd)
+        sftp_close (tfd->replicas[i]);
+
+  pthread_mutex_destroy (&tfd->mutex);
+  err = sftp_close (tfd->fd);
+  free (tfd->replicas);
+  free (tfd->unusable);
+  free (tfd->data);
+  free (tfd->buf);
+  free (tfd->path);
+  free (tfd);
+  return err;
+}
+
+/* the handle on mirror child `i', opening it if need be. the caller must
+ * hold tfd->mutex */
+static struct sftp_fd *
+replica_fd (struct sftp_tree_fd *tfd, size_t i)
+{
+  struct args a = {tfd->path, (void *) (size_t) tfd->flags,
+                   (void *) (size_t) O_RDONLY};
+  struct sftp_fd *fd;
+  struct stat st;
+  int failed;
+
+  if (NULL != tfd->replicas[i] || tfd->unusable[i])
+    return tfd->replicas[i];
+
+  /* a copy that differs from the one we started with would mix two
+   * versions of the file into one read */
+  if (NULL == (fd = traverse_tree (list_get (tfd->where.mirror->children, i),
+                                   &open_op, &a, &failed))
+      || sftp_fstat_cached (fd, &st) < 0 || st.st_size != tfd->st.st_size
+      || st.st_mtime != tfd->st.st_mtime)
+    {
+      print_error ("Replica %lu of `%s' unusable for striping", i,
+                   tfd->path);
+      if (NULL != fd)
+        sftp_close (fd);
+      tfd->unusable[i] = 1;
+      return NULL;
+    }
+
+  return tfd->replicas[i] = fd;
+}
+
+static void
+stripe_run (void *arg)
+{
+  struct stripe *sp = arg;
+
+  sp->got = sftp_read (sp->fd, sp->buf, sp->size, sp->offset);
+
+  pthread_mutex_lock (&sp->set->mutex);
+  sp->set->pending--;
+  pthread_mutex_unlock (&sp->set->mutex);
+}
+
+static int
+stripes_done (void *arg)
+{
+  struct stripe_set *set = arg;
+  int done;
+
+  pthread_mutex_lock (&set->mutex);
+  done = 0 == set->pending;
+  pthread_mutex_unlock (&set->mutex);
+  return done;
+}
+
+/* read [offset, offset + size) split across every usable replica. returns
+ * the length of the prefix that was read, like sftp_read. the caller must
+ * hold tfd->mutex */
+static ssize_t
+striped_read (struct sftp_tree_fd *tfd, char *buf, size_t size, off_t offset)
+{
+  size_t n = list_count (tfd->where.mirror->children);
+  struct stripe_set set;
+  struct stripe stripes[n];
+  struct sftp_fd *fds[n];
+  struct sftp_fd *fd;
+  size_t nfds = 0;
+  size_t part;
+  size_t i;
+  ssize_t done = 0;
+
+  /* ours first, it runs on this thread */
+  fds[nfds++] = tfd->fd;
+  for (i = 0; i < n && nfds * STRIPE_MIN < size; i++)
+    if (i != tfd->where.replica && NULL != (fd = replica_fd (tfd, i)))
+      fds[nfds++] = fd;
+
+  if (1 == nfds)
+    return sftp_read (tfd->fd, buf, size, offset);
+
+  /* equal parts, rounded so that they line up with cache blocks */
+  part = (size + nfds - 1) / nfds;
+  part = (part + STRIPE_MIN - 1) / STRIPE_MIN * STRIPE_MIN;
+
+  pthread_mutex_init (&set.mutex, NULL);
+  set.pending = 0;
+  for (i = 0; i * part < size; i++)
+    {
+      stripes[i].set = &set;
+      stripes[i].fd = fds[i];
+      stripes[i].buf = buf + i * part;
+      stripes[i].offset = offset + i * part;
+      stripes[i].size = size - i * part < part ? size - i * part : part;
+      stripes[i].got = -1;
+    }
+  nfds = i;
+
+  for (i = 1; i < nfds; i++)
+    {
+      pthread_mutex_lock (&set.mutex);
+      set.pending++;
+      pthread_mutex_unlock (&set.mutex);
+      if (workq_submit (workq, stripe_run, &stripes[i], &set) < 0)
+        {
+          pthread_mutex_lock (&set.mutex);
+          set.pending--;
+          pthread_mutex_unlock (&set.mutex);
+          stripes[i].got = sftp_read (stripes[i].fd, stripes[i].buf,
+                                      stripes[i].size, stripes[i].offset);
+        }
+    }
+
+  stripes[0].got = sftp_read (stripes[0].fd, stripes[0].buf,
+                              stripes[0].size, stripes[0].offset);
+  workq_wait (workq, stripes_done, &set);
+  pthread_mutex_destroy (&set.mutex);
+
+  /* stitch the parts together, anything a replica failed to deliver is
+   * fetched again from ours. a part missing altogether fails the read, what
+   * came before it is not passed off as the end of the file */
+  for (i = 0; i < nfds; i++)
+    {
+      struct stripe *sp = &stripes[i];
+
+      if (sp->got < 0 && 0 != i)
+        sp->got = sftp_read (tfd->fd, sp->buf, sp->size, sp->offset);
+      if (sp->got < 0)
+        return -1;
+
+      done += sp->got;
+      if ((size_t) sp->got < sp->size)
+        break;
+    }
+
+  return done;
+}
+
+static void
+hedged_read_unref (struct hedged_read *h)
+{
+  int last;
+
+  pthread_mutex_lock (&h->mutex);
+  last = 0 == --h->refs;
+  pthread_mutex_unlock (&h->mutex);
+
+  if (last)
+    {
+      pthread_mutex_destroy (&h->mutex);
+      free (h);
+    }
+}
+
+static void
+hedged_read_run (void *arg)
+{
+  struct hedged_read_task *t = arg;
+  struct hedged_read *h = t->h;
+  struct sftp_tree_fd *tfd = t->tfd;
+  ssize_t got;
+
+  if (t->backup)
+    got = sftp_pread (t->fd, t->buf, t->size, t->offset);
+  else
+    got = sftp_read (t->fd, t->buf, t->size, t->offset);
+
+  pthread_mutex_lock (&h->mutex);
+  if (!h->won && 0 <= got)
+    {
+      h->won = 1;
+      h->got = got;
+      memcpy (h->out, t->buf, got);
+    }
+  h->pending--;
+  pthread_mutex_unlock (&h->mutex);
+
+  hedged_read_unref (h);
+  free (t);
+
+  /* last, sftp_tree_close may free the handle right after */
+  __sync_fetch_and_sub (&tfd->hedging, 1);
+}
+
+static int
+hedged_read_done (void *arg)
+{
+  struct hedged_read *h = arg;
+  int done;
+
+  pthread_mutex_lock (&h->mutex);
+  done = h->won || 0 == h->pending;
+  pthread_mutex_unlock (&h->mutex);
+  return done;
+}
+
+/* send the read to `fd'. only the first one goes through the handle's
+ * read-ahead, a backup sent to another replica's handle reads just what was
+ * asked for: it is thrown away as often as not, and that handle may be
+ * streaming a stripe of its own */
+static void
+hedged_read_add (struct hedged_read *h, struct sftp_tree_fd *tfd,
+                 struct sftp_fd *fd, size_t size, off_t offset, int backup)
+{
+  struct hedged_read_task *t;
+
+  if (NULL == (t = malloc (sizeof *t + size)))
+    {
+      print_error ("Out of memory");
+      return;
+    }
+
+  t->h = h;
+  t->tfd = tfd;
+  t->fd = fd;
+  t->backup = backup;
+  t->size = size;
+  t->offset = offset;
+
+  pthread_mutex_lock (&h->mutex);
+  h->refs++;
+  h->pending++;
+  pthread_mutex_unlock (&h->mutex);
+  __sync_fetch_and_add (&tfd->hedging, 1);
+
+  if (workq_submit (workq, hedged_read_run, t, h) < 0)
+    hedged_read_run (t);
+}
+
+/* a plain read of a file below a mirror, hedged on another replica if it
+ * takes too long. the caller must hold tfd->mutex */
+static ssize_t
+mirror_read (struct sftp_tree_fd *tfd, char *buf, size_t size, off_t offset)
+{
+  struct sftp_node *mirror = tfd->where.mirror;
+  struct hedged_read *h;
+  struct sftp_fd *fd;
+  uint64_t start = now_ns ();
+  uint64_t delay;
+  ssize_t got;
+  size_t i;
+
+  if (0 == (delay = hedge_delay (mirror, &mirror->read_latency))
+      || NULL == (h = calloc (1, sizeof *h)))
+    {
+      got = sftp_read (tfd->fd, buf, size, offset);
+      goto exit;
+    }
+
+  pthread_mutex_init (&h->mutex, NULL);
+  h->out = buf;
+  h->got = -1;
+  h->refs = 1;
+
+  hedged_read_add (h, tfd, tfd->fd, size, offset, 0);
+  if (workq_timedwait (workq, hedged_read_done, h, delay) < 0
+      && hedge_take (mirror))
+    {
+      pthread_mutex_lock (&mirror->mutex);
+      i = replica_choose (mirror, tfd->where.replica);
+      pthread_mutex_unlock (&mirror->mutex);
+      if (NULL != (fd = replica_fd (tfd, i)))
+        hedged_read_add (h, tfd, fd, size, offset, 1);
+    }
+
+  workq_wait (workq, hedged_read_done, h);
+  pthread_mutex_lock (&h->mutex);
+  got = h->got;
+  pthread_mutex_unlock (&h->mutex);
+  hedged_read_unref (h);
+
+exit:
+  if (0 <= got)
+    {
+      pthread_mutex_lock (&mirror->mutex);
+      latency_add (&mirror->read_latency, now_ns () - start);
+      pthread_mutex_unlock (&mirror->mutex);
+    }
+  return got;
+}
+
+ssize_t
+sftp_tree_read (struct sftp_tree_fd *tfd, void *buf, size_t size,
+                off_t offset)
+{
+  size_t done = 0;
+  int sequential;
+  int failed = 0;
+
+  if (NULL == tfd || NULL == buf || 0 == size)
+    {
+      print_error ("Invalid arguments");
+      return -1;
+    }
+
+  if (NULL != tfd->data)
+    {
+      if (offset < 0 || tfd->data_len <= (size_t) offset)
+        return 0;
+      if (tfd->data_len - offset < size)
+        size = tfd->data_len - offset;
+      memcpy (buf, tfd->data + offset, size);
+      return size;
+    }
+
+  if (NULL == tfd->where.mirror)
+    return sftp_read (tfd->fd, buf, size, offset);
+
+  pthread_mutex_lock (&tfd->mutex);
+
+  sequential = (offset == tfd->next);
+  if (!sequential)
+    tfd->window = STRIPE_WINDOW_MIN;
+  else if (tfd->window < STRIPE_WINDOW_MAX)
+    tfd->window = tfd->window ? tfd->window * 2 : STRIPE_WINDOW_MIN;
+  tfd->next = offset + size;
+
+  while (done < size)
+    {
+      size_t want;
+      ssize_t got;
+
+      /* whatever the read-ahead buffer holds */
+      if (tfd->start <= offset + (off_t) done
+          && offset + (off_t) done < (off_t) (tfd->start + tfd->len))
+        {
+          size_t skip = offset + done - tfd->start;
+          size_t n = tfd->len - skip < size - done ? tfd->len - skip
+                                                    : size - done;
+          memcpy ((char *) buf + done, tfd->buf + skip, n);
+          done += n;
+          continue;
+        }
+
+      if (tfd->eof && (off_t) (tfd->start + tfd->len) == offset + (off_t) done)
+        break;
+
+      /* random reads go straight to the caller's buffer, and only get split
+       * up if they are big enough */
+      if (!sequential)
+        {
+          if (size - done < 2 * STRIPE_MIN)
+            got = mirror_read (tfd, (char *) buf + done, size - done,
+                               offset + done);
+          else
+            got = striped_read (tfd, (char *) buf + done, size - done,
+                                offset + done);
+          if (got < 0)
+            failed = 1;
+          else
+            done += got;
+          break;
+        }
+
+      want = size - done < tfd->window ? tfd->window : size - done;
+      if (tfd->size < want)
+        {
+          char *p;
+          if (NULL == (p = realloc (tfd->buf, want)))
+            {
+              print_error ("Out of memory");
+              failed = 1;
+              break;
+            }
+          tfd->buf = p;
+          tfd->size = want;
+        }
+
+      tfd->start = offset + done;
+      tfd->len = 0;
+      if ((got = striped_read (tfd, tfd->buf, want, tfd->start)) < 0)
+        {
+          failed = 1;
+          break;
+        }
+      tfd->len = got;
+      /* only the size the file was opened with says where it ends */
+      tfd->eof = tfd->st.st_size <= tfd->start + (off_t) got;
+      if (0 == got)
+        break;
+    }
+
+  pthread_mutex_unlock (&tfd->mutex);
+
+  /* a short count means end of file, anything short of it that went wrong
+   * fails the read rather than handing back a truncated buffer */
+  if (failed)
+    return -1;
+  return done;
+}
+
+/* read all of a file no larger than `max' bytes in one go, for the reads
+ * that follow to be answered from memory. the size is known from the open,
+ * so the whole file goes out as one pipelined request instead of one per
+ * read the caller would otherwise make. must be called before the handle
+ * is shared. returns 1 if the file is now in memory, 0 if it was not worth
+ * it and -1 if reading failed */
+int
+sftp_tree_prefetch (struct sftp_tree_fd *tfd, size_t max)
+{
+  size_t size;
+  ssize_t got;
+  char *data;
+
+  if (NULL == tfd)
+    {
+      print_error ("Invalid arguments");
+      return -1;
+    }
+
+  if (NULL != tfd->data)
+    return 1;
+  if (!S_ISREG (tfd->st.st_mode) || tfd->st.st_size < 0
+      || max < (size_t) tfd->st.st_size)
+    return 0;
+
+  /* one byte more than it should have, to tell whether it is complete */
+  size = tfd->st.st_size;
+  if (NULL == (data = malloc (size + 1)))
+    {
+      print_error ("Out of memory");
+      return -1;
+    }
+
+  if (NULL != tfd->where.mirror)
+    got = mirror_read (tfd, data, size + 1, 0);
+  else
+    got = sftp_read (tfd->fd, data, size + 1, 0);
+
+  /* a file that changed size since the open is left to the usual reads */
+  if ((size_t) got != size)
+    {
+      free (data);
+      return got < 0 ? -1 : 0;
+    }
+
+  tfd->data = data;
+  tfd->data_len = size;
+  return 1;
+}
+
+/* a directory listed through the tree. below a distribute node every child
+ * holds part of the directory, so all of them are listed at once, each as a
+ * task of its own on the listing workers, and the names are merged as they
+ * come in: the first child to send a name wins and later copies are dropped.
+ * a mirror lists just one of its replicas.
+ *
+ * a task reads one batch per turn and then goes to the back of the queue, so
+ * a huge directory does not keep a worker from everyone else. it stops
+ * altogether while the reader has DIR_PENDING_MAX entries yet to take, and
+ * the reader sends it on again once it has caught up. */
+struct sftp_tree_dir
+{
+  pthread_mutex_t mutex;
+  char *path;
+
+  /* entries received but not yet handed out, oldest first */
+  struct dir_entry *head;
+  struct dir_entry *tail;
+  size_t pending;
+
+  /* listings waiting for the reader to catch up */
+  struct dir_task *parked;
+
+  /* hashes of every name seen so far, kept only when a distribute node
+   * merges several listings */
+  uint64_t *names;
+  size_t names_size;
+  size_t names_count;
+
+  size_t producers;
+  size_t opened;
+  size_t refs;
+  int closed;
+};
+
+struct dir_entry
+{
+  struct dir_entry *next;
+  struct stat st;
+  char name[NAME_MAX + 1];
+};
+
+struct dir_task
+{
+  struct sftp_tree_dir *dir;
+  struct sftp_node *node;
+  /* the distribute node closest above `node' and which child it is under */
+  struct sftp_node *dst;
+  uint32_t child;
+  /* once open, the listing and the buffer its batches are read into */
+  struct sftp_dir *d;
+  void *batch;
+  struct dir_task *next;
+};
+
+#define DIR_NAMES_MIN 64
+
+/* past this many names duplicates are let through rather than growing the
+ * table beyond 16M */
+#define DIR_NAMES_MAX (512 * 1024)
+
+/* how much of a listing a child fetches at a time */
+#define DIR_BATCH (64 * 1024)
+
+/* how far the listings may get ahead of the reader */
+#define DIR_PENDING_MAX 4096
+
+/* entries come and go by the thousand on a large listing */
+static struct pool *entry_pool = NULL;
+static pthread_once_t entry_pool_once = PTHREAD_ONCE_INIT;
+
+static void
+entry_pool_init (void)
+{
+  entry_pool = pool_new ("dir_entry", sizeof (struct dir_entry));
+}
+
+static uint64_t
+name_hash (const char *name)
+{
+  uint64_t h = 14695981039346656037ULL;
+
+  while (*name)
+    {
+      h ^= (unsigned char) *name++;
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+/* add `name' to the names of `dir' unless it is there already. returns 1 if
+ * it was new. names are told apart by a 64 bit hash, two of them colliding
+ * in one directory is not worth a copy of every name. the caller must hold
+ * dir->mutex */
+static int
+dir_name_add (struct sftp_tree_dir *dir, const char *name)
+{
+  uint64_t h = name_hash (name);
+  size_t i;
+
+  /* 0 marks a free slot */
+  if (0 == h)
+    h = 1;
+
+  if (DIR_NAMES_MAX <= dir->names_count)
+    {
+      if (DIR_NAMES_MAX == dir->names_count++)
+        print_error ("Over %d names in `%s', duplicates may show",
+                     DIR_NAMES_MAX, dir->path);
+      return 1;
+    }
+
+  /* keep the table at most half full */
+  if (dir->names_size <= 2 * (dir->names_count + 1))
+    {
+      size_t size = dir->names_size ? 2 * dir->names_size : DIR_NAMES_MIN;
+      uint64_t *names;
+
+      if (NULL == (names = calloc (size, sizeof *names)))
+        {
+          print_error ("Out of memory");
+          return 1;
+        }
+      for (i = 0; i < dir->names_size; i++)
+        if (0 != dir->names[i])
+          {
+            size_t j = dir->names[i] & (size - 1);
+            while (0 != names[j])
+              j = (j + 1) & (size - 1);
+            names[j] = dir->names[i];
+          }
+      free (dir->names);
+      dir->names = names;
+      dir->names_size = size;
+    }
+
+  for (i = h & (dir->names_size - 1); 0 != dir->names[i];
+       i = (i + 1) & (dir->names_size - 1))
+    if (dir->names[i] == h)
+      return 0;
+
+  dir->names[i] = h;
+  dir->names_count++;
+  return 1;
+}
+
+static void
+dir_unref (struct sftp_tree_dir *dir)
+{
+  struct dir_entry *e;
+  int last;
+
+  pthread_mutex_lock (&dir->mutex);
+  last = 0 == --dir->refs;
+  pthread_mutex_unlock (&dir->mutex);
+
+  if (!last)
+    return;
+
+  while (NULL != (e = dir->head))
+    {
+      dir->head = e->next;
+      pool_put (entry_pool, e);
+    }
+  free (dir->names);
+  pthread_mutex_destroy (&dir->mutex);
+  free (dir->path);
+  free (dir);
+}
+
+/* queue a batch of `len' bytes of entries for the reader, all under one
+ * hold of the lock, dropping the names a sibling already sent. returns -1
+ * once the reader has gone away */
+static int
+dir_push (struct sftp_tree_dir *dir, struct sftp_dirent *batch, size_t len,
+          struct sftp_node *dst, uint32_t child)
+{
+  struct sftp_dirent *d;
+  struct dir_entry *e;
+  struct sftp_dirent *end = (struct sftp_dirent *) ((char *) batch + len);
+  int wake;
+
+  pthread_mutex_lock (&dir->mutex);
+  if (dir->closed)
+    {
+      pthread_mutex_unlock (&dir->mutex);
+      return -1;
+    }
+
+  wake = NULL == dir->head;
+  for (d = batch; d < end; d = SFTP_DIRENT_NEXT (d))
+    {
+      /* without a distribute node there is only one listing */
+      if (NULL != dst && !dir_name_add (dir, d->name))
+        continue;
+      if (NULL == (e = pool_get (entry_pool)))
+        {
+          print_error ("Out of memory");
+          break;
+        }
+
+      e->next = NULL;
+      e->st = d->st;
+      strcpy (e->name, d->name);
+      if (NULL == dir->tail)
+        dir->head = e;
+      else
+        dir->tail->next = e;
+      dir->tail = e;
+      dir->pending++;
+    }
+  wake = wake && NULL != dir->head;
+  pthread_mutex_unlock (&dir->mutex);
+
+  /* the listing tells where the entries live, save their lookups a
+   * fan-out. a name dropped as a duplicate is still here, so it is as good
+   * a place to look as the one that won */
+  if (NULL != dst)
+    for (d = batch; d < end; d = SFTP_DIRENT_NEXT (d))
+      if (strcmp (d->name, ".") && strcmp (d->name, ".."))
+        {
+          char path[PATH_MAX];
+          if (snprintf (path, sizeof path, "%s/%s",
+                        strcmp (dir->path, "/") ? dir->path : "", d->name)
+              < (int) sizeof path)
+            lru_put (dst->locations, path, strlen (path), &child,
+                     sizeof child);
+        }
+
+  if (wake && NULL != listq)
+    workq_signal (listq);
+  return 0;
+}
+
+static void dir_task_add (struct sftp_tree_dir *dir, struct sftp_node *node,
+                          struct sftp_node *dst, uint32_t child);
+
+/* open the listing of `node' for task `t', setting t->d if it is a volume.
+ * returns 0 if the directory could not be opened there, children of a
+ * distribute node get tasks of their own and report for themselves */
+static int
+dir_list (struct dir_task *t, struct sftp_node *node)
+{
+  struct sftp_tree_dir *dir = t->dir;
+  struct sftp_dir *d;
+  size_t n;
+  size_t i;
+
+  switch (node->type)
+    {
+      case SFTP_VOL:
+        if (NULL == (d = sftp_opendir (node->sftp_ctx, dir->path)))
+          return 0;
+
+        pthread_mutex_lock (&dir->mutex);
+        dir->opened++;
+        pthread_mutex_unlock (&dir->mutex);
+        if (NULL != listq)
+          workq_signal (listq);
+
+        if (NULL == (t->batch = malloc (DIR_BATCH)))
+          {
+            print_error ("Out of memory");
+            sftp_closedir (d);
+          }
+        else
+          t->d = d;
+        return 1;
+      case SFTP_MIR:
+        /* a listing is too long running to say much about latency, so the
+         * replica is only chosen, not accounted for */
+        n = list_count (node->children);
+        pthread_mutex_lock (&node->mutex);
+        i = replica_choose (node, n);
+        pthread_mutex_unlock (&node->mutex);
+        if (dir_list (t, list_get (node->children, i)) || 1 == n)
+          return 1;
+
+        pthread_mutex_lock (&node->mutex);
+        i = replica_choose (node, i);
+        pthread_mutex_unlock (&node->mutex);
+        return dir_list (t, list_get (node->children, i));
+      case SFTP_DST:
+        for (i = 0; i < list_count (node->children); i++)
+          dir_task_add (dir, list_get (node->children, i), node, i);
+        return 1;
+    }
+
+  return 0;
+}
+
+/* a listing is done, or its reader has gone away */
+static void
+dir_task_end (struct dir_task *t)
+{
+  struct sftp_tree_dir *dir = t->dir;
+
+  if (NULL != t->d)
+    sftp_closedir (t->d);
+  free (t->batch);
+  free (t);
+
+  pthread_mutex_lock (&dir->mutex);
+  dir->producers--;
+  pthread_mutex_unlock (&dir->mutex);
+  if (NULL != listq)
+    workq_signal (listq);
+  dir_unref (dir);
+}
+
+static void
+dir_task_run (void *arg)
+{
+  struct dir_task *t = arg;
+  struct sftp_tree_dir *dir = t->dir;
+  ssize_t len;
+
+  /* first time round, find the directory and open it */
+  if (NULL == t->d)
+    {
+      dir_list (t, t->node);
+      if (NULL == t->d)
+        {
+          dir_task_end (t);
+          return;
+        }
+    }
+
+  for (;;)
+    {
+      if ((len = sftp_readdir (t->d, t->batch, DIR_BATCH)) <= 0
+          || dir_push (dir, t->batch, len, t->dst, t->child) < 0)
+        {
+          dir_task_end (t);
+          return;
+        }
+
+      /* nobody to hand the rest to, finish it here */
+      if (NULL == listq)
+        continue;
+
+      pthread_mutex_lock (&dir->mutex);
+      if (DIR_PENDING_MAX <= dir->pending)
+        {
+          t->next = dir->parked;
+          dir->parked = t;
+          pthread_mutex_unlock (&dir->mutex);
+          return;
+        }
+      pthread_mutex_unlock (&dir->mutex);
+
+      /* give the other listings a turn */
+      if (0 == workq_submit (listq, dir_task_run, t, dir))
+        return;
+    }
+}
+
+/* list `node' on a listing worker, or right here without any */
+static void
+dir_task_add (struct sftp_tree_dir *dir, struct sftp_node *node,
+              struct sftp_node *dst, uint32_t child)
+{
+  struct dir_task *t;
+
+  if (NULL == (t = calloc (1, sizeof *t)))
+    {
+      print_error ("Out of memory");
+      return;
+    }
+
+  t->dir = dir;
+  t->node = node;
+  t->dst = dst;
+  t->child = child;
+
+  pthread_mutex_lock (&dir->mutex);
+  dir->producers++;
+  dir->refs++;
+  pthread_mutex_unlock (&dir->mutex);
+
+  if (NULL == listq || workq_submit (listq, dir_task_run, t, dir) < 0)
+    dir_task_run (t);
+}
+
+static int
+dir_opened (void *arg)
+{
+  struct sftp_tree_dir *dir = arg;
+  int done;
+
+  pthread_mutex_lock (&dir->mutex);
+  done = 0 < dir->opened || 0 == dir->producers;
+  pthread_mutex_unlock (&dir->mutex);
+  return done;
+}
+
+static int
+dir_ready (void *arg)
+{
+  struct sftp_tree_dir *dir = arg;
+  int done;
+
+  pthread_mutex_lock (&dir->mutex);
+  done = NULL != dir->head || 0 == dir->producers;
+  pthread_mutex_unlock (&dir->mutex);
+  return done;
+}
+
+struct sftp_tree_dir *
+sftp_tree_opendir (struct sftp_node *root, const char *path)
+{
+  struct sftp_tree_dir *dir;
+  size_t opened;
+
+  if (NULL == root || NULL == path)
+    {
+      print_error ("Invalid arguments");
+      return NULL;
+    }
+
+  if (NULL == (dir = calloc (1, sizeof *dir))
+      || NULL == (dir->path = strdup (path)))
+    {
+      print_error ("Out of memory");
+      free (dir);
+      return NULL;
+    }
+
+  pthread_once (&entry_pool_once, entry_pool_init);
+  pthread_mutex_init (&dir->mutex, NULL);
+  dir->refs = 1;
+
+  /* the root itself is listed on a worker too, so that opening returns as
+   * soon as the first child has the directory open */
+  dir_task_add (dir, root, NULL, 0);
+  if (NULL != listq)
+    workq_wait (listq, dir_opened, dir);
+
+  /* nobody left to open it means nobody could */
+  pthread_mutex_lock (&dir->mutex);
+  opened = dir->opened;
+  pthread_mutex_unlock (&dir->mutex);
+  if (0 == opened)
+    {
+      sftp_tree_closedir (dir);
+      errno = ENOENT;
+      return NULL;
+    }
+
+  return dir;
+}
+
+/* fill `buf' with the next entries of `dir' the way sftp_readdir does,
+ * waiting for the children if none have come in yet. returns the number of
+ * bytes filled, 0 once every child is done */
+ssize_t
+sftp_tree_readdir (struct sftp_tree_dir *dir, void *buf, size_t size)
+{
+  struct dir_entry *e, *taken = NULL;
+  struct dir_task *t, *resume = NULL;
+  struct sftp_dirent *d = buf;
+  size_t done = 0;
+  size_t reclen;
+
+  if (NULL == dir || NULL == buf || size < SFTP_DIRENT_MAX)
+    {
+      print_error ("Invalid arguments");
+      return -1;
+    }
+
+  if (NULL != listq)
+    workq_wait (listq, dir_ready, dir);
+
+  pthread_mutex_lock (&dir->mutex);
+  while (NULL != (e = dir->head)
+         && (reclen = SFTP_DIRENT_SIZE (strlen (e->name))) <= size - done)
+    {
+      dir->head = e->next;
+      if (NULL == dir->head)
+        dir->tail = NULL;
+      dir->pending--;
+
+      d->reclen = reclen;
+      d->st = e->st;
+      strcpy (d->name, e->name);
+      done += reclen;
+      d = SFTP_DIRENT_NEXT (d);
+
+      e->next = taken;
+      taken = e;
+    }
+
+  /* caught up far enough to let the listings go on */
+  if (dir->pending <= DIR_PENDING_MAX / 2)
+    {
+      resume = dir->parked;
+      dir->parked = NULL;
+    }
+  pthread_mutex_unlock (&dir->mutex);
+
+  while (NULL != (e = taken))
+    {
+      taken = e->next;
+      pool_put (entry_pool, e);
+    }
+
+  while (NULL != (t = resume))
+    {
+      resume = t->next;
+      if (workq_submit (listq, dir_task_run, t, dir) < 0)
+        dir_task_run (t);
+    }
+  return done;
+}
+
+int
+sftp_tree_closedir (struct sftp_tree_dir *dir)
+{
+  struct dir_task *t, *parked;
+
+  if (NULL == dir)
+    return -1;
+
+  /* listings still running stop at their next batch, those waiting for
+   * the reader stop right away */
+  pthread_mutex_lock (&dir->mutex);
+  dir->closed = 1;
+  parked = dir->parked;
+  dir->parked = NULL;
+  pthread_mutex_unlock (&dir->mutex);
+
+  while (NULL != (t = parked))
+    {
+      parked = t->next;
+      dir_task_end (t);
+    }
+  dir_unref (dir);
+  return 0;
+}
+
+static void
+node_stats (struct sftp_node *root, FILE *fp, const char *name, int depth)
+{
+  uint64_t now = now_ns ();
+  size_t i;
+
+  switch (root->type)
+    {
+      case SFTP_VOL:
+        fprintf (fp, "%*svolume %s\n", depth * 2, "", root->name);
+        return;
+      case SFTP_DST:
+        fprintf (fp, "%*sdistribute %s\n", depth * 2, "", name);
+        break;
+      case SFTP_MIR:
+        pthread_mutex_lock (&root->mutex);
+        fprintf (fp, "%*smirror %s: %lu hedges\n", depth * 2, "", name,
+                 root->hedges);
+        pthread_mutex_unlock (&root->mutex);
+        break;
+    }
+
+  for (i = 0; i < list_count (root->children); i++)
+    {
+      struct sftp_node *child = list_get (root->children, i);
+      char id[32];
+
+      snprintf (id, sizeof id, "%s.%lu", name, i);
+      if (SFTP_MIR == root->type)
+        {
+          struct replica rp;
+
+          pthread_mutex_lock (&root->mutex);
+          rp = root->replicas[i];
+          pthread_mutex_unlock (&root->mutex);
+          fprintf (fp, "%*sreplica %lu: %s, %.3f ms, %u in flight, "
+                   "%lu requests, %lu errors\n", depth * 2 + 2, "", i,
+                   now < rp.down_until ? "down" : "up", rp.latency / 1e6,
+                   rp.inflight, rp.requests, rp.errors);
+        }
+      node_stats (child, fp, id, depth + 1);
+    }
+}
+
+/* describe the tree and the health of every mirror replica */
+void
+sftp_tree_stats (struct sftp_node *root, FILE *fp)
+{
+  if (NULL == root || NULL == fp)
+    return;
+
+  node_stats (root, fp, "0", 0);
+}
+
+/* the same, for a monitoring agent: every counter in the Prometheus text
+ * format. nodes are labelled with the ids node_stats gives them, volumes
+ * with their names. samples of one metric have to come together, so the
+ * tree is walked once per metric */
+
+struct metric_walk
+{
+  FILE *fp;
+  const char *metric;
+  int op;
+};
+
+static void
+metric_head (FILE *fp, const char *metric, const char *type,
+             const char *help)
+{
+  fprintf (fp, "# HELP %s %s\n# TYPE %s %s\n", metric, help, metric, type);
+}
+
+/* a label value, with what the format wants escaped */
+static void
+metric_label (FILE *fp, const char *value)
+{
+  for (; '\0' != *value; value++)
+    if ('\\' == *value || '"' == *value)
+      fprintf (fp, "\\%c", *value);
+    else if ('\n' == *value)
+      fputs ("\\n", fp);
+    else
+      fputc (*value, fp);
+}
+
+static void
+node_walk (struct sftp_node *root, const char *id,
+           void (*fn) (struct sftp_node *, const char *, struct metric_walk *),
+           struct metric_walk *w)
+{
+  size_t i;
+
+  fn (root, id, w);
+  if (SFTP_VOL == root->type)
+    return;
+
+  for (i = 0; i < list_count (root->children); i++)
+    {
+      char child[32];
+      snprintf (child, sizeof child, "%s.%lu", id, i);
+      node_walk (list_get (root->children, i), child, fn, w);
+    }
+}
+
+/* the upper bound of the bucket holding the `permille'-th permille of `op',
+ * in seconds */
+static double
+op_quantile (const struct sftp_op_stats *op, unsigned long permille)
+{
+  uint64_t want = (op->requests * permille + 999) / 1000;
+  uint64_t seen = 0;
+  size_t b;
+
+  for (b = 0; b < SFTP_LATENCY_BUCKETS - 1; b++)
+    if (want <= (seen += op->latency[b]))
+      break;
+  return (2ULL << b) / 1e6;
+}
+
+static void
+volume_ops (struct sftp_node *node, const char *id, struct metric_walk *w)
+{
+  static const unsigned long quantiles[] = {500, 990, 999};
+  struct sftp_stats st;
+  struct sftp_op_stats *op;
+  size_t i, q;
+  (void) id;
+
+  if (SFTP_VOL != node->type)
+    return;
+
+  sftp_stats (node->sftp_ctx, &st);
+  for (i = 0; i < SFTP_OPS; i++)
+    {
+      op = &st.ops[i];
+      if (0 == op->requests)
+        continue;
+
+      if (0 == w->op)
+        {
+          for (q = 0; q < sizeof quantiles / sizeof *quantiles; q++)
+            {
+              fprintf (w->fp, "%s{volume=\"", w->metric);
+              metric_label (w->fp, node->name);
+              fprintf (w->fp, "\",op=\"%s\",quantile=\"%g\"} %g\n", op->op,
+                       quantiles[q] / 1000.0, op_quantile (op, quantiles[q]));
+            }
+          fprintf (w->fp, "%s_sum{volume=\"", w->metric);
+          metric_label (w->fp, node->name);
+          fprintf (w->fp, "\",op=\"%s\"} %.9f\n", op->op, op->ns / 1e9);
+          fprintf (w->fp, "%s_count{volume=\"", w->metric);
+          metric_label (w->fp, node->name);
+          fprintf (w->fp, "\",op=\"%s\"} %lu\n", op->op, op->requests);
+        }
+      else
+        {
+          fprintf (w->fp, "%s{volume=\"", w->metric);
+          metric_label (w->fp, node->name);
+          fprintf (w->fp, "\",op=\"%s\"} %lu\n", op->op, op->errors);
+        }
+    }
+}
+
+enum
+{
+  VOLUME_READ_BYTES,
+  VOLUME_LOCK_WAITS,
+  VOLUME_LOCK_WAIT_SECONDS,
+  VOLUME_SESSIONS,
+  VOLUME_QUEUED
+};
+
+static void
+volume_value (struct sftp_node *node, const char *id, struct metric_walk *w)
+{
+  struct sftp_stats st;
+  (void) id;
+
+  if (SFTP_VOL != node->type)
+    return;
+
+  sftp_stats (node->sftp_ctx, &st);
+  fprintf (w->fp, "%s{volume=\"", w->metric);
+  metric_label (w->fp, node->name);
+  fputs ("\"} ", w->fp);
+  switch (w->op)
+    {
+      case VOLUME_READ_BYTES:
+        fprintf (w->fp, "%lu\n", st.read_bytes);
+        break;
+      case VOLUME_LOCK_WAITS:
+        fprintf (w->fp, "%lu\n", st.lock_waits);
+        break;
+      case VOLUME_LOCK_WAIT_SECONDS:
+        fprintf (w->fp, "%.9f\n", st.lock_wait_ns / 1e9);
+        break;
+      case VOLUME_SESSIONS:
+        fprintf (w->fp, "%zu\n", st.sessions);
+        break;
+      case VOLUME_QUEUED:
+        fprintf (w->fp, "%zu\n", st.queued);
+        break;
+    }
+}
+
+enum
+{
+  REPLICA_UP,
+  REPLICA_REQUESTS,
+  REPLICA_ERRORS,
+  REPLICA_INFLIGHT,
+  REPLICA_LATENCY,
+  MIRROR_HEDGES
+};
+
+static void
+mirror_value (struct sftp_node *node, const char *id, struct metric_walk *w)
+{
+  uint64_t now = now_ns ();
+  struct replica *rp;
+  size_t i;
+
+  if (SFTP_MIR != node->type)
+    return;
+
+  pthread_mutex_lock (&node->mutex);
+  if (MIRROR_HEDGES == w->op)
+    fprintf (w->fp, "%s{node=\"%s\"} %lu\n", w->metric, id, node->hedges);
+  else
+    for (i = 0; i < list_count (node->children); i++)
+      {
+        rp = &node->replicas[i];
+        fprintf (w->fp, "%s{node=\"%s\",replica=\"%lu\"} ", w->metric, id, i);
+        switch (w->op)
+          {
+            case REPLICA_UP:
+              fprintf (w->fp, "%d\n", now < rp->down_until ? 0 : 1);
+              break;
+            case REPLICA_REQUESTS:
+              fprintf (w->fp, "%lu\n", rp->requests);
+              break;
+            case REPLICA_ERRORS:
+              fprintf (w->fp, "%lu\n", rp->errors);
+              break;
+            case REPLICA_INFLIGHT:
+              fprintf (w->fp, "%u\n", rp->inflight);
+              break;
+            case REPLICA_LATENCY:
+              fprintf (w->fp, "%.9f\n", rp->latency / 1e9);
+              break;
+          }
+      }
+  pthread_mutex_unlock (&node->mutex);
+}
+
+enum
+{
+  LOCATION_HITS,
+  LOCATION_MISSES,
+  LOCATION_ENTRIES
+};
+
+static void
+distribute_value (struct sftp_node *node, const char *id,
+                  struct metric_walk *w)
+{
+  struct lru_stats st;
+
+  if (SFTP_DST != node->type)
+    return;
+
+  lru_stats (node->locations, &st);
+  fprintf (w->fp, "%s{node=\"%s\"} %lu\n", w->metric, id,
+           LOCATION_HITS == w->op ? st.hits
+           : LOCATION_MISSES == w->op ? st.misses : st.entries);
+}
+
+void
+sftp_tree_metrics (struct sftp_node *root, FILE *fp)
+{
+  static const struct
+  {
+    void (*fn) (struct sftp_node *, const char *, struct metric_walk *);
+    int op;
+    const char *metric;
+    const char *type;
+    const char *help;
+  } metrics[] =
+  {
+    {volume_ops, 0, "arsenal_sftp_request_seconds", "summary",
+     "Time SFTP requests took, queueing on the channel included."},
+    {volume_ops, 1, "arsenal_sftp_errors_total", "counter",
+     "SFTP requests that failed."},
+    {volume_value, VOLUME_READ_BYTES, "arsenal_sftp_read_bytes_total",
+     "counter", "File data read from the volume."},
+    {volume_value, VOLUME_LOCK_WAITS, "arsenal_sftp_lock_waits_total",
+     "counter", "Requests that waited for a handle in use by another."},
+    {volume_value, VOLUME_LOCK_WAIT_SECONDS,
+     "arsenal_sftp_lock_wait_seconds_total", "counter",
+     "Time spent waiting for handles in use by another request."},
+    {volume_value, VOLUME_SESSIONS, "arsenal_sftp_sessions", "gauge",
+     "SSH sessions open to the volume."},
+    {volume_value, VOLUME_QUEUED, "arsenal_sftp_queued_requests", "gauge",
+     "Requests queued on the volume's SFTP channels."},
+    {mirror_value, MIRROR_HEDGES, "arsenal_mirror_hedges_total", "counter",
+     "Requests duplicated to a second replica."},
+    {mirror_value, REPLICA_UP, "arsenal_replica_up", "gauge",
+     "Whether the replica is being sent requests."},
+    {mirror_value, REPLICA_REQUESTS, "arsenal_replica_requests_total",
+     "counter", "Requests routed to the replica."},
+    {mirror_value, REPLICA_ERRORS, "arsenal_replica_errors_total", "counter",
+     "Requests that failed on the replica."},
+    {mirror_value, REPLICA_INFLIGHT, "arsenal_replica_inflight_requests",
+     "gauge", "Requests running on the replica."},
+    {mirror_value, REPLICA_LATENCY, "arsenal_replica_latency_seconds",
+     "gauge", "Moving average of the replica's request time."},
+    {distribute_value, LOCATION_HITS, "arsenal_location_hits_total",
+     "counter", "Paths routed to a known child without asking all."},
+    {distribute_value, LOCATION_MISSES, "arsenal_location_misses_total",
+     "counter", "Paths that had to be looked for on every child."},
+    {distribute_value, LOCATION_ENTRIES, "arsenal_locations", "gauge",
+     "Paths whose child is known."}
+  };
+  struct metric_walk w;
+  size_t i;
+
+  if (NULL == root || NULL == fp)
+    return;
+
+  w.fp = fp;
+  for (i = 0; i < sizeof metrics / sizeof *metrics; i++)
+    {
+      metric_head (fp, metrics[i].metric, metrics[i].type, metrics[i].help);
+      w.metric = metrics[i].metric;
+      w.op = metrics[i].op;
+      node_walk (root, "0", metrics[i].fn, &w);
+    }
 }
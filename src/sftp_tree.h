@@ -1,10 +1,13 @@
 #ifndef SFTP_TREE_H
 #define SFTP_TREE_H
 
+#include <stdio.h>
 #include <sys/stat.h>
 #include <sftp.h>
 
 struct sftp_node;
+struct sftp_tree_fd;
+struct sftp_tree_dir;
 
 struct sftp_node *
 sftp_tree_init (const char *path, const char *mount_point);
@@ -22,15 +25,40 @@ ssize_t
 sftp_tree_realpath (struct sftp_node *root, const char *path, char *buf,
                     size_t bufsize);
 
-struct sftp_fd *
+struct sftp_tree_fd *
 sftp_tree_open (struct sftp_node *root, const char *path, int flags,
                 mode_t mode);
 
+int
+sftp_tree_fstat (struct sftp_tree_fd *tfd, struct stat *buf);
+
+ssize_t
+sftp_tree_read (struct sftp_tree_fd *tfd, void *buf, size_t size,
+                off_t offset);
+
+int
+sftp_tree_prefetch (struct sftp_tree_fd *tfd, size_t max);
+
+int
+sftp_tree_close (struct sftp_tree_fd *tfd);
+
 int
 sftp_tree_statvfs (struct sftp_node *root, const char *path,
                    struct statvfs *buf);
 
-struct sftp_dir *
+struct sftp_tree_dir *
 sftp_tree_opendir (struct sftp_node *root, const char *path);
 
+ssize_t
+sftp_tree_readdir (struct sftp_tree_dir *dir, void *buf, size_t size);
+
+int
+sftp_tree_closedir (struct sftp_tree_dir *dir);
+
+void
+sftp_tree_stats (struct sftp_node *root, FILE *fp);
+
+void
+sftp_tree_metrics (struct sftp_node *root, FILE *fp);
+
 #endif
@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <workq.h>
+#include <pool.h>
+#include <debug.h>
+
+/* a fixed pool of threads running submitted jobs in FIFO order.
+ *
+ * jobs may themselves submit more jobs and wait for them (a fan-out below a
+ * fan-out in the volume tree), so a thread blocked in workq_wait runs queued
+ * jobs instead of sleeping. that way a waiter can never starve the pool of
+ * the very threads it is waiting for. it only runs jobs submitted on behalf
+ * of what it waits for, though: anybody else's may take far longer than the
+ * waiter's own and would hold it up for nothing. its own jobs are either
+ * still queued, and then it runs them, or already running somewhere. */
+
+struct job
+{
+  void (*func) (void *);
+  void *arg;
+  void *owner;
+  struct job *next;
+};
+
+struct workq
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct job *head;
+  struct job *tail;
+  pthread_t *threads;
+  size_t nthreads;
+  int stop;
+};
+
+/* jobs are taken and given back at the rate requests fan out */
+static struct pool *job_pool = NULL;
+static pthread_once_t job_pool_once = PTHREAD_ONCE_INIT;
+
+static void
+job_pool_init (void)
+{
+  job_pool = pool_new ("job", sizeof (struct job));
+}
+
+/* the caller must hold q->mutex */
+static struct job *
+job_pop (struct workq *q)
+{
+  struct job *j = q->head;
+
+  if (NULL != j)
+    {
+      q->head = j->next;
+      if (NULL == q->head)
+        q->tail = NULL;
+    }
+  return j;
+}
+
+/* take the oldest job submitted on behalf of `owner' out of the queue. the
+ * caller must hold q->mutex */
+static struct job *
+job_pop_owned (struct workq *q, void *owner)
+{
+  struct job *j, *prev = NULL;
+
+  for (j = q->head; NULL != j; prev = j, j = j->next)
+    if (j->owner == owner)
+      {
+        if (NULL == prev)
+          q->head = j->next;
+        else
+          prev->next = j->next;
+        if (q->tail == j)
+          q->tail = prev;
+        break;
+      }
+  return j;
+}
+
+/* run `j' without the lock held and wake up everyone waiting on its result */
+static void
+job_run (struct workq *q, struct job *j)
+{
+  pthread_mutex_unlock (&q->mutex);
+  j->func (j->arg);
+  pool_put (job_pool, j);
+  pthread_mutex_lock (&q->mutex);
+  pthread_cond_broadcast (&q->cond);
+}
+
+static void *
+worker (void *arg)
+{
+  struct workq *q = arg;
+  struct job *j;
+
+  pthread_mutex_lock (&q->mutex);
+  while (!q->stop)
+    {
+      if (NULL != (j = job_pop (q)))
+        job_run (q, j);
+      else
+        pthread_cond_wait (&q->cond, &q->mutex);
+    }
+  pthread_mutex_unlock (&q->mutex);
+  return NULL;
+}
+
+struct workq *
+workq_new (size_t nthreads)
+{
+  struct workq *q;
+  size_t i;
+  int err;
+
+  if (NULL == (q = calloc (1, sizeof *q))
+      || NULL == (q->threads = calloc (nthreads, sizeof *q->threads)))
+    {
+      print_error ("Out of memory");
+      free (q);
+      return NULL;
+    }
+
+  pthread_once (&job_pool_once, job_pool_init);
+  pthread_mutex_init (&q->mutex, NULL);
+  pthread_cond_init (&q->cond, NULL);
+
+  for (i = 0; i < nthreads; i++)
+    {
+      if (0 != (err = pthread_create (&q->threads[i], NULL, worker, q)))
+        {
+          print_error ("pthread_create: %s", strerror (err));
+          break;
+        }
+      q->nthreads++;
+    }
+
+  if (0 == q->nthreads)
+    {
+      workq_free (q);
+      return NULL;
+    }
+
+  return q;
+}
+
+void
+workq_free (struct workq *q)
+{
+  struct job *j;
+  size_t i;
+
+  if (NULL == q)
+    return;
+
+  pthread_mutex_lock (&q->mutex);
+  q->stop = 1;
+  pthread_cond_broadcast (&q->cond);
+  pthread_mutex_unlock (&q->mutex);
+
+  for (i = 0; i < q->nthreads; i++)
+    pthread_join (q->threads[i], NULL);
+
+  /* nobody is left to run them, but their owners still expect them to */
+  while (NULL != (j = job_pop (q)))
+    {
+      j->func (j->arg);
+      pool_put (job_pool, j);
+    }
+
+  pthread_cond_destroy (&q->cond);
+  pthread_mutex_destroy (&q->mutex);
+  free (q->threads);
+  free (q);
+}
+
+/* queue func (arg). `owner' is the argument of the workq_wait that will wait
+ * for the job, which may then run it itself, or NULL if nobody does */
+int
+workq_submit (struct workq *q, void (*func) (void *), void *arg, void *owner)
+{
+  struct job *j;
+
+  if (NULL == q || NULL == func)
+    {
+      print_error ("Invalid arguments");
+      return -1;
+    }
+
+  if (NULL == (j = pool_get (job_pool)))
+    {
+      print_error ("Out of memory");
+      return -1;
+    }
+
+  j->func = func;
+  j->arg = arg;
+  j->owner = owner;
+  j->next = NULL;
+
+  pthread_mutex_lock (&q->mutex);
+  if (NULL == q->tail)
+    q->head = j;
+  else
+    q->tail->next = j;
+  q->tail = j;
+  pthread_cond_broadcast (&q->cond);
+  pthread_mutex_unlock (&q->mutex);
+  return 0;
+}
+
+/* block until done (arg) holds, which must become true as a result of some
+ * job finishing. queued jobs submitted with `arg' as their owner are run on
+ * the calling thread in the meantime. */
+void
+workq_wait (struct workq *q, int (*done) (void *), void *arg)
+{
+  struct job *j;
+
+  pthread_mutex_lock (&q->mutex);
+  while (!done (arg))
+    {
+      if (NULL != (j = job_pop_owned (q, arg)))
+        job_run (q, j);
+      else
+        pthread_cond_wait (&q->cond, &q->mutex);
+    }
+  pthread_mutex_unlock (&q->mutex);
+}
+
+/* wake up everyone in workq_wait to check their condition again. jobs call
+ * this when they change what a waiter is waiting for before they finish */
+void
+workq_signal (struct workq *q)
+{
+  pthread_mutex_lock (&q->mutex);
+  pthread_cond_broadcast (&q->cond);
+  pthread_mutex_unlock (&q->mutex);
+}
+
+/* like workq_wait but gives up after `timeout' ns, returning -1. it does not
+ * run jobs itself, one might take longer than the caller is willing to wait,
+ * so it must be followed by a workq_wait if it times out. */
+int
+workq_timedwait (struct workq *q, int (*done) (void *), void *arg,
+                 uint64_t timeout)
+{
+  struct timespec ts;
+  int err = 0;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  timeout += ts.tv_nsec;
+  ts.tv_sec += timeout / 1000000000;
+  ts.tv_nsec = timeout % 1000000000;
+
+  pthread_mutex_lock (&q->mutex);
+  while (!done (arg) && ETIMEDOUT != err)
+    err = pthread_cond_timedwait (&q->cond, &q->mutex, &ts);
+  err = done (arg) ? 0 : -1;
+  pthread_mutex_unlock (&q->mutex);
+  return err;
+}
@@ -0,0 +1,28 @@
+#ifndef _H_WORKQ
+#define _H_WORKQ
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct workq;
+
+struct workq *
+workq_new (size_t nthreads);
+
+void
+workq_free (struct workq *q);
+
+int
+workq_submit (struct workq *q, void (*func) (void *), void *arg, void *owner);
+
+void
+workq_wait (struct workq *q, int (*done) (void *), void *arg);
+
+void
+workq_signal (struct workq *q);
+
+int
+workq_timedwait (struct workq *q, int (*done) (void *), void *arg,
+                 uint64_t timeout);
+
+#endif